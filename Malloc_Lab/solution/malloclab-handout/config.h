@@ -58,9 +58,14 @@
 #define ALIGNMENT 8  
 
 /* 
- * Maximum heap size in bytes 
+ * Maximum heap size in bytes. The LD_PRELOAD shim (mmshim.c) serves a
+ * whole process, so it reserves as much as mm.c's 32-bit offsets reach.
  */
+#ifdef MM_SHIM
+#define MAX_HEAP (1UL<<31)     /* 2 GB */
+#else
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
+#endif
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
@@ -0,0 +1,488 @@
+/*
+ * gentrace.c - generate a synthetic tracefile for the malloc driver
+ *
+ * usage: gentrace [-b] [-n <ops>] [-s <dist>] [-l <dist>] [-p <pattern>]
+ *                 [-r <frac>] [-c <dist>] [-g <factor>] [-m <bytes>]
+ *                 [-a <frac>] [-A <align>] [-z <frac>] [-S <seed>] <out>
+ *
+ * Sizes, lifetimes and realloc chain lengths are drawn from a
+ * distribution given as one of
+ *
+ *     uniform:LO:HI   every integer in [LO, HI] equally often
+ *     exp:MEAN        exponential with the given mean (at least 1)
+ *     pow2:LO:HI      powers of two in [LO, HI], each equally often
+ *     pareto:MIN:A    heavy tailed, MIN or more with shape A
+ *
+ * A lifetime is the number of requests between the malloc of a block
+ * and its free. The pattern decides the order of the frees:
+ *
+ *     random    each block is freed when its own lifetime runs out
+ *     fifo      blocks are freed in the order they were allocated,
+ *               as with a queue between a producer and a consumer
+ *     prodcons  a producer allocates a batch of blocks, whose size is
+ *               drawn from the lifetime distribution, and a consumer
+ *               then frees the whole batch, oldest first
+ *
+ * A fraction of the mallocs starts a realloc chain: the block is grown
+ * by the growth factor a number of times drawn from the chain length
+ * distribution, interleaved with the other requests. Other fractions
+ * of the mallocs ask for aligned blocks instead, as memalign requests,
+ * or for zeroed ones, as calloc requests.
+ *
+ * Ids are reused once their block is freed, so the driver's arrays are
+ * only as long as the most blocks live at once. At most <bytes> of
+ * payload are live at once. Only the blocks the mm package keeps in its
+ * heap count against the driver's MAX_HEAP, huge blocks are mapped
+ * outside it. The trace ends by freeing every live block. The output is
+ * written as it is generated, so the length of a trace is bounded only
+ * by the disk; -b writes the binary format of trace.h instead of .rep.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "trace.h"
+
+#define MAXSIZE (1<<28)  /* largest request size */
+
+/* Types of distribution */
+enum {UNIFORM, EXP, POW2, PARETO};
+
+/* A distribution parsed from the command line */
+typedef struct {
+    int kind;
+    double a, b;
+} dist_t;
+
+/* Types of pattern */
+enum {RANDOM, FIFO, PRODCONS};
+
+/* A live block, a node of the min-heap ordered by death */
+typedef struct {
+    unsigned long long death;  /* request number at which it is freed */
+    int id;
+} live_t;
+
+/* Generator state */
+static FILE *out;
+static int binary = 0;
+static unsigned align = 64;   /* alignment of the memalign requests */
+static unsigned long long seed = 0x9e3779b97f4a7c15ULL;
+static live_t *heap;          /* live blocks, soonest death first */
+static int nlive = 0;
+static int *sizes;            /* current size of each id */
+static int *chain;            /* realloc steps left for each id */
+static int *chainpos;         /* position of each id in chains, or -1 */
+static int *chains;           /* ids that have realloc steps left */
+static int nchains = 0;
+static int *freeids;          /* ids free for reuse */
+static int nfreeids = 0;
+static int num_ids = 0;
+static int max_ids = 0;       /* length of the arrays above */
+static long long live_bytes = 0;
+static long long peak_bytes = 0;
+static int nops = 0;          /* requests written so far */
+
+static void app_error(char *msg, char *arg)
+{
+    fprintf(stderr, "%s %s\n", msg, arg);
+    exit(1);
+}
+
+/*
+ * rnd - return a uniform random number in [0, 1) (xorshift64*)
+ */
+static double rnd(void)
+{
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return (double)((seed * 0x2545f4914f6cdd1dULL) >> 11) / 9007199254740992.0;
+}
+
+/*
+ * parse_dist - parse a distribution of the form KIND:A[:B]
+ */
+static dist_t parse_dist(char *spec)
+{
+    dist_t d;
+    char kind[16];
+    int n;
+
+    d.a = d.b = 0;
+    n = sscanf(spec, "%15[a-z2]:%lf:%lf", kind, &d.a, &d.b);
+    if (n >= 3 && !strcmp(kind, "uniform"))
+	d.kind = UNIFORM;
+    else if (n >= 2 && !strcmp(kind, "exp"))
+	d.kind = EXP;
+    else if (n >= 3 && !strcmp(kind, "pow2"))
+	d.kind = POW2;
+    else if (n >= 3 && !strcmp(kind, "pareto"))
+	d.kind = PARETO;
+    else
+	app_error("Bad distribution", spec);
+    if (d.a < 0 || (d.kind != EXP && d.kind != PARETO && d.b < d.a) ||
+	(d.kind == PARETO && d.b <= 0))
+	app_error("Bad distribution", spec);
+    return d;
+}
+
+/*
+ * sample - draw a value of at least 1 from a distribution
+ */
+static long long sample(dist_t *d)
+{
+    double v = 1;
+    int lo, hi;
+
+    switch (d->kind) {
+    case UNIFORM:
+	v = d->a + floor(rnd() * (d->b - d->a + 1));
+	break;
+    case EXP:
+	v = floor(-d->a * log(1 - rnd()) + 0.5);
+	break;
+    case POW2:
+	lo = (int)ceil(log2(d->a > 1 ? d->a : 1));
+	hi = (int)floor(log2(d->b > 1 ? d->b : 1));
+	v = ldexp(1, lo + (int)(rnd() * (hi - lo + 1)));
+	break;
+    case PARETO:
+	v = floor(d->a / pow(1 - rnd(), 1 / d->b));
+	break;
+    }
+    if (v > 1e15)
+	v = 1e15;
+    return (v < 1) ? 1 : (long long)v;
+}
+
+/*
+ * emit - write one request
+ */
+static void emit(int type, int id, int size)
+{
+    traceop_t op;
+
+    nops++;
+    if (binary) {
+	op.type = type;
+	op.index = id;
+	op.size = size;
+	op.align = (type == MEMALIGN) ? align : 0;
+	fwrite(&op, sizeof(op), 1, out);
+    }
+    else if (type == ALLOC)
+	fprintf(out, "a %d %d\n", id, size);
+    else if (type == MEMALIGN)
+	fprintf(out, "m %d %u %d\n", id, align, size);
+    else if (type == CALLOC)
+	fprintf(out, "c %d %d\n", id, size);
+    else if (type == REALLOC)
+	fprintf(out, "r %d %d\n", id, size);
+    else
+	fprintf(out, "f %d\n", id);
+}
+
+/*
+ * write_header - write the header, padded to a fixed length in a .rep
+ *     file so that it can be rewritten once the counts are known
+ */
+static void write_header(int num_ops)
+{
+    trace_header_t header;
+    int heapsize = (peak_bytes > 0x7fffffff) ? 0x7fffffff : (int)peak_bytes;
+
+    rewind(out);
+    if (binary) {
+	header.magic = TRACE_MAGIC;
+	header.version = TRACE_VERSION;
+	header.sugg_heapsize = heapsize;
+	header.num_ids = num_ids;
+	header.num_ops = num_ops;
+	header.weight = 1;
+	fwrite(&header, sizeof(header), 1, out);
+    }
+    else
+	fprintf(out, "%-11d\n%-11d\n%-11d\n%-11d\n",
+		heapsize, num_ids, num_ops, 1);
+    fseek(out, 0, SEEK_END);
+}
+
+/*
+ * heap_push, heap_pop - add a live block, remove the soonest to die
+ */
+static void heap_push(unsigned long long death, int id)
+{
+    int i = nlive++;
+
+    while (i > 0 && heap[(i-1)/2].death > death) {
+	heap[i] = heap[(i-1)/2];
+	i = (i-1)/2;
+    }
+    heap[i].death = death;
+    heap[i].id = id;
+}
+
+static int heap_pop(void)
+{
+    int id = heap[0].id;
+    live_t last = heap[--nlive];
+    int i = 0, child;
+
+    while ((child = 2*i + 1) < nlive) {
+	if (child + 1 < nlive && heap[child+1].death < heap[child].death)
+	    child++;
+	if (heap[child].death >= last.death)
+	    break;
+	heap[i] = heap[child];
+	i = child;
+    }
+    heap[i] = last;
+    return id;
+}
+
+/*
+ * chain_remove - drop an id from the list of growing blocks
+ */
+static void chain_remove(int id)
+{
+    int pos = chainpos[id];
+
+    if (pos < 0)
+	return;
+    chains[pos] = chains[--nchains];
+    chainpos[chains[pos]] = pos;
+    chainpos[id] = -1;
+}
+
+/*
+ * free_block - free the live block that dies soonest
+ */
+static void free_block(void)
+{
+    int id = heap_pop();
+
+    chain_remove(id);
+    live_bytes -= sizes[id];
+    freeids[nfreeids++] = id;
+    emit(FREE, id, 0);
+}
+
+/*
+ * new_id - return an id that has never been used, growing the arrays
+ *     indexed by id (or by the number of live ids) when they are full
+ */
+static int new_id(void)
+{
+    if (num_ids == max_ids) {
+	max_ids = max_ids ? 2 * max_ids : 1024;
+	if ((heap = realloc(heap, max_ids * sizeof(live_t))) == NULL ||
+	    (sizes = realloc(sizes, max_ids * sizeof(int))) == NULL ||
+	    (chain = realloc(chain, max_ids * sizeof(int))) == NULL ||
+	    (chainpos = realloc(chainpos, max_ids * sizeof(int))) == NULL ||
+	    (chains = realloc(chains, max_ids * sizeof(int))) == NULL ||
+	    (freeids = realloc(freeids, max_ids * sizeof(int))) == NULL)
+	    app_error("Out of memory for", "ids");
+    }
+    return num_ids++;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: gentrace [-b] [-n <ops>] [-s <dist>] [-l <dist>] "
+	    "[-p <pattern>] [-r <frac>] [-c <dist>] [-g <factor>] "
+	    "[-m <bytes>] [-a <frac>] [-A <align>] [-z <frac>] [-S <seed>] <out>\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b            Write a binary trace.\n");
+    fprintf(stderr, "\t-n <ops>      Number of requests (default 100000).\n");
+    fprintf(stderr, "\t-s <dist>     Request sizes (default pow2:8:4096).\n");
+    fprintf(stderr, "\t-l <dist>     Lifetimes in requests, or batch sizes for prodcons (default exp:1000).\n");
+    fprintf(stderr, "\t-p <pattern>  random, fifo or prodcons (default random).\n");
+    fprintf(stderr, "\t-r <frac>     Fraction of mallocs that start a realloc chain (default 0).\n");
+    fprintf(stderr, "\t-c <dist>     Reallocs in a chain (default uniform:1:16).\n");
+    fprintf(stderr, "\t-g <factor>   Growth of each realloc in a chain (default 1.5).\n");
+    fprintf(stderr, "\t-m <bytes>    Most payload bytes live at once (default 8388608).\n");
+    fprintf(stderr, "\t-a <frac>     Fraction of mallocs that are memalign requests (default 0).\n");
+    fprintf(stderr, "\t-A <align>    Alignment of the memalign requests (default 64).\n");
+    fprintf(stderr, "\t-z <frac>     Fraction of mallocs that are calloc requests (default 0).\n");
+    fprintf(stderr, "\t-S <seed>     Seed of the random numbers.\n");
+    fprintf(stderr, "\tdist is uniform:LO:HI, exp:MEAN, pow2:LO:HI or pareto:MIN:SHAPE\n");
+}
+
+int main(int argc, char **argv)
+{
+    long long num_ops = 100000;
+    long long max_live = 8 << 20;
+    dist_t size_dist = parse_dist("pow2:8:4096");
+    dist_t life_dist = parse_dist("exp:1000");
+    dist_t chain_dist = parse_dist("uniform:1:16");
+    double chain_frac = 0, growth = 1.5, align_frac = 0, zero_frac = 0;
+    int pattern = RANDOM;
+    unsigned long long now, death, last_death = 0;
+    long long batch = 0, v;
+    int producing = 1;
+    int c, id, size, type;
+
+    while ((c = getopt(argc, argv, "bn:s:l:p:r:c:g:m:a:A:z:S:h")) != EOF) {
+	switch (c) {
+	case 'b':
+	    binary = 1;
+	    break;
+	case 'n':
+	    num_ops = atoll(optarg);
+	    break;
+	case 's':
+	    size_dist = parse_dist(optarg);
+	    break;
+	case 'l':
+	    life_dist = parse_dist(optarg);
+	    break;
+	case 'p':
+	    if (!strcmp(optarg, "random"))
+		pattern = RANDOM;
+	    else if (!strcmp(optarg, "fifo"))
+		pattern = FIFO;
+	    else if (!strcmp(optarg, "prodcons"))
+		pattern = PRODCONS;
+	    else
+		app_error("Bad pattern", optarg);
+	    break;
+	case 'r':
+	    chain_frac = atof(optarg);
+	    break;
+	case 'c':
+	    chain_dist = parse_dist(optarg);
+	    break;
+	case 'g':
+	    growth = atof(optarg);
+	    break;
+	case 'm':
+	    max_live = atoll(optarg);
+	    break;
+	case 'a':
+	    align_frac = atof(optarg);
+	    break;
+	case 'A':
+	    align = (unsigned)strtoul(optarg, NULL, 0);
+	    break;
+	case 'z':
+	    zero_frac = atof(optarg);
+	    break;
+	case 'S':
+	    seed = strtoull(optarg, NULL, 0) * 0x9e3779b97f4a7c15ULL + 1;
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (optind != argc - 1 || num_ops < 2 || num_ops > 0x7fffffff ||
+	max_live < 1 || growth < 1 || align == 0 || (align & (align - 1)) != 0) {
+	usage();
+	exit(1);
+    }
+    if ((out = fopen(argv[optind], "wb")) == NULL)
+	app_error("Could not create", argv[optind]);
+
+    write_header(0);
+
+    for (now = 0; now < (unsigned long long)num_ops; now++) {
+	/* The remaining requests are just enough to free the live blocks */
+	if ((long long)(num_ops - now) <= nlive) {
+	    free_block();
+	    continue;
+	}
+
+	/* Free the next block when its time has come */
+	if (nlive > 0) {
+	    if (pattern == PRODCONS ? !producing : heap[0].death <= now) {
+		free_block();
+		if (pattern == PRODCONS && --batch <= 0)
+		    producing = 1;
+		continue;
+	    }
+	}
+
+	/* Otherwise grow a block in a realloc chain half of the time */
+	if (nchains > 0 && rnd() < 0.5) {
+	    id = chains[(int)(rnd() * nchains)];
+	    size = (int)ceil(sizes[id] * growth);
+	    size = (size > MAXSIZE) ? MAXSIZE : size;
+	    if (live_bytes + size - sizes[id] <= max_live) {
+		live_bytes += size - sizes[id];
+		peak_bytes = (live_bytes > peak_bytes) ? live_bytes : peak_bytes;
+		sizes[id] = size;
+		emit(REALLOC, id, size);
+		if (--chain[id] <= 0 || size == MAXSIZE)
+		    chain_remove(id);
+		continue;
+	    }
+	}
+
+	/* Or allocate a new block, unless that would pass the live limit */
+	v = sample(&size_dist);
+	size = (v > MAXSIZE) ? MAXSIZE : (int)v;
+	if ((long long)(num_ops - now) <= nlive + 1) {
+	    if (nlive == 0)
+		break;  /* one request left, with nothing to free */
+	    free_block();
+	    continue;
+	}
+	if (nlive > 0 && live_bytes + size > max_live) {
+	    free_block();
+	    if (pattern == PRODCONS && !producing && --batch <= 0)
+		producing = 1;
+	    continue;
+	}
+	id = nfreeids > 0 ? freeids[--nfreeids] : new_id();
+	sizes[id] = size;
+	live_bytes += size;
+	peak_bytes = (live_bytes > peak_bytes) ? live_bytes : peak_bytes;
+	type = ALLOC;
+	if (align_frac > 0 && rnd() < align_frac)
+	    type = MEMALIGN;
+	else if (zero_frac > 0 && rnd() < zero_frac)
+	    type = CALLOC;
+	emit(type, id, size);
+
+	/* Decide when it will be freed */
+	switch (pattern) {
+	case RANDOM:
+	    heap_push(now + sample(&life_dist), id);
+	    break;
+	case FIFO:
+	    /* strictly later than the last one, since the heap is not stable */
+	    death = now + sample(&life_dist);
+	    last_death = (death > last_death) ? death : last_death + 1;
+	    heap_push(last_death, id);
+	    break;
+	case PRODCONS:
+	    heap_push(now, id);
+	    if (batch == 0)
+		batch = sample(&life_dist);
+	    if (--batch <= 0) {
+		producing = 0;
+		batch = nlive;
+	    }
+	    break;
+	}
+
+	/* And whether it starts a realloc chain */
+	chainpos[id] = -1;
+	if (chain_frac > 0 && rnd() < chain_frac) {
+	    chain[id] = (int)sample(&chain_dist);
+	    chainpos[id] = nchains;
+	    chains[nchains++] = id;
+	}
+    }
+
+    write_header(nops);
+    if (fclose(out) != 0)
+	app_error("Could not write", argv[optind]);
+    return 0;
+}
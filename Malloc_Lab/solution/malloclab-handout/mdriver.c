@@ -15,11 +15,18 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
 #include "config.h"
+#include "trace.h"
 
 /**********************
  * Constants and macros
@@ -29,28 +36,34 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define MAXTHREADS    64 /* max number of replay threads (-T, -Q) */
+#define RING_SLOTS  1024 /* frees a producer passes its consumer at once (-Q) */
+#define RING_BYTES (1<<16) /* payload bytes a producer lets its consumer leave unfreed (-Q) */
+#define NPOLICIES      3 /* placement policies of mm.h, compared by -p */
+
+/* Latency histograms (-L) */
+#define LAT_SUBBITS    2 /* log2 of the linear sub-buckets per power of two */
+#define LAT_BUCKETS  128 /* log-scale buckets of cycle counts */
+#define LAT_CLASSES   12 /* request sizes <=16, <=32, ... <=16K, larger */
+#define LAT_OPS        5 /* indexed by ALLOC, FREE, REALLOC, MEMALIGN and CALLOC */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
 /****************************** 
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* Records the extent of each block's payload, a node of an AVL tree 
+   ordered by lo. Payloads never overlap, so lo orders hi as well. */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    struct range_t *left;  /* ranges below lo */
+    struct range_t *right; /* ranges above hi */
+    int height;            /* height of this subtree */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file*/
 typedef struct {
     int sugg_heapsize;   /* suggested heap size (unused) */
@@ -60,6 +73,8 @@ typedef struct {
     traceop_t *ops;      /* array of requests */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    void *map;           /* mapping of a binary trace file, ops point into it */
+    size_t map_len;      /* length of that mapping */
 } trace_t;
 
 /* 
@@ -70,8 +85,30 @@ typedef struct {
 typedef struct {
     trace_t *trace;  
     range_t *ranges;
+    int nthreads;    /* number of replay threads or pairs (eval_mm_threads, eval_mm_pairs) */
+    char **blocks;   /* num_ids block ptrs for each thread (ditto) */
+    size_t *sizes;   /* and their payload sizes (eval_mm_pairs only) */
+    int failed;      /* set if some thread ran out of memory (ditto) */
 } speed_t;
 
+/* Carries the blocks a producer thread frees over to its consumer (-Q) */
+typedef struct {
+    char *slots[RING_SLOTS];
+    size_t sizes[RING_SLOTS];  /* payload size of the block in each slot */
+    unsigned long head __attribute__((aligned(64))); /* slots the consumer took */
+    size_t freed;              /* payload bytes the consumer freed */
+    unsigned long tail __attribute__((aligned(64))); /* slots the producer filled */
+    size_t passed;             /* payload bytes the producer passed */
+} ring_t;
+
+/* Holds the params to one replay thread started by eval_mm_threads or eval_mm_pairs */
+typedef struct {
+    speed_t *speed;
+    char **blocks;   /* this thread's array of ptrs returned by malloc... */
+    size_t *sizes;   /* ... and their payload sizes (eval_mm_pairs only) */
+    ring_t *ring;    /* the ring of its producer/consumer pair (eval_mm_pairs only) */
+} thread_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -81,6 +118,15 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    size_t peak_heap;     /* highest heap size while running the trace */
+    size_t final_heap;    /* heap size after running the trace */
+    size_t resident_heap; /* bytes of the final heap backed by memory */
+                          /* (the three include the mapped regions) */
+    double reallocs;      /* number of reallocs in the trace */
+    double inplace;       /* reallocs that returned or remapped the old block */
+    double copied;        /* payload bytes moved by the other reallocs */
+    double avoided;       /* payload bytes the in place reallocs did not move */
+    unsigned lat[LAT_OPS][LAT_CLASSES][LAT_BUCKETS]; /* cycles per request (-L) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -90,6 +136,10 @@ typedef struct {
  *******************/
 int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
+static int latency = 0; /* if set, histogram the cycles of each request (-L) */
+static int heap_check = 0; /* if set, have mm_check the whole heap after every request (-c) */
+static int profile = 0; /* if set, sample the heap layout every this many requests (-P) */
+static char *profile_file = "heap.prof"; /* time series of the samples (-o) */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
 /* Directory where default tracefiles are found */
@@ -100,6 +150,10 @@ static char *default_tracefiles[] = {
     DEFAULT_TRACEFILES, NULL
 };
 
+/* The placement policies, indexed by their MM_*_FIT numbers */
+static char *policy_names[NPOLICIES] = {"best fit", "first fit", "next fit"};
+static char *policy_tags[NPOLICIES] = {"best", "first", "next"};
+
 
 /********************* 
  * Function prototypes 
@@ -110,23 +164,68 @@ static int add_range(range_t **ranges, char *lo, int size,
 		     int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static range_t *range_insert(range_t *root, range_t *p);
+static range_t *range_delete(range_t *root, char *lo);
+static range_t *range_delete_min(range_t *root);
+static range_t *range_balance(range_t *root);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static int map_trace(trace_t *trace, char *path);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
 static void eval_libc_speed(void *ptr);
+static char *libc_alloc(traceop_t *op);
 
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
+static void eval_mm_traces(char **tracefiles, int n, int njobs, stats_t *stats);
+static void eval_mm_trace(char *filename, int tracenum, stats_t *stats);
+static void eval_mm_jobs(char **tracefiles, int n, int njobs, stats_t *stats);
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   stats_t *stats);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(trace_t *trace, stats_t *stats);
+static void eval_mm_profile(trace_t *trace, int tracenum);
+static void write_profile_header(void);
+static double *eval_mm_scaling(char **tracefiles, int n, stats_t *stats,
+			       int nconfigs, int *counts, void (*eval)(void *));
+static void eval_mm_threads(void *ptr);
+static void *eval_mm_thread(void *ptr);
+static void eval_mm_pairs(void *ptr);
+static void *eval_mm_producer(void *ptr);
+static void *eval_mm_consumer(void *ptr);
+static void ring_put(ring_t *ring, char *p, size_t size);
+static char *ring_get(ring_t *ring);
+static void ring_done(ring_t *ring);
+static void ring_wait(ring_t *ring);
+static char *mm_alloc(traceop_t *op);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printheaps(int n, stats_t *stats);
+static void printreallocs(int n, stats_t *stats);
+static void printlatency(int n, stats_t *stats);
+static void printlatclasses(int n, stats_t *stats);
+static void printlatcols(unsigned *hist);
+
+/* these functions build and read the latency histograms */
+static unsigned long long read_tsc(void);
+static int lat_bucket(unsigned long long cycles);
+static unsigned long long lat_value(int bucket);
+static int lat_class(size_t size);
+static void lat_merge(unsigned *hist, stats_t *stats, int op, int class);
+static double lat_percentile(unsigned *hist, double q);
+static int scaling_counts(int max, int *counts);
+static void printthreads(int n, stats_t *stats, int nconfigs, 
+			 int *nthreads, double *secs, char unit);
+static void printdeferred(int n, stats_t *stats, stats_t *deferred_stats);
+static void printfooters(int n, stats_t *stats, stats_t *footer_stats);
+static void printpolicies(int n, stats_t **policy_stats);
+static void read_classes(char *path, mm_classes_t *classes);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -142,14 +241,30 @@ int main(int argc, char **argv)
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
     trace_t *trace = NULL;     /* stores a single trace file in memory */
-    range_t *ranges = NULL;    /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
+    stats_t *deferred_stats = NULL; /* mm stats with deferred coalescing */
+    stats_t *footer_stats = NULL;   /* mm stats with footers on allocated blocks */
+    stats_t *policy_stats[NPOLICIES];/* mm stats with each placement policy */
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
 
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int max_threads = 0; /* If set, replay up to this many copies (-T) */
+    int max_pairs = 0;   /* If set, replay up to this many producer/consumer pairs (-Q) */
+    int njobs = 0;       /* If set, evaluate this many traces at once (-j) */
+    int run_deferred = 0;/* If set, run mm with deferred coalescing too (-d) */
+    int run_footers = 0; /* If set, run mm with footers on allocated blocks too (-F) */
+    int run_policies = 0;/* If set, run mm with every placement policy (-p) */
+    mm_classes_t classes;/* free list classes and chunk sizes read by -C */
+    int saved_profile;
+
+    /* thread or pair counts and run times of the threaded replays (-T, -Q) */
+    int nthreads[MAXTHREADS];
+    int nconfigs = 0;
+    double *thread_secs = NULL;
+    int j;
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,21 +273,20 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:T:Q:j:P:o:C:hvVgalLcdpF")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
 	    break;
-        case 'f': /* Use one specific trace file only (relative to curr dir) */
-            num_tracefiles = 1;
-            if ((tracefiles = realloc(tracefiles, 2*sizeof(char *))) == NULL)
+        case 'f': /* Use specific trace files only (relative to curr dir) */
+            if ((tracefiles = realloc(tracefiles, (num_tracefiles+2)*sizeof(char *))) == NULL)
 		unix_error("ERROR: realloc failed in main");
 	    strcpy(tracedir, "./"); 
-            tracefiles[0] = strdup(optarg);
-            tracefiles[1] = NULL;
+            tracefiles[num_tracefiles++] = strdup(optarg);
+            tracefiles[num_tracefiles] = NULL;
             break;
 	case 't': /* Directory where the traces are located */
-	    if (num_tracefiles == 1) /* ignore if -f already encountered */
+	    if (num_tracefiles > 0) /* ignore if -f already encountered */
 		break;
 	    strcpy(tracedir, optarg);
 	    if (tracedir[strlen(tracedir)-1] != '/') 
@@ -181,9 +295,60 @@ int main(int argc, char **argv)
         case 'a': /* Don't check team structure */
             team_check = 0;
             break;
+        case 'T': /* Replay each trace on up to this many threads */
+            max_threads = atoi(optarg);
+            if (max_threads < 1 || max_threads > MAXTHREADS) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'Q': /* Replay each trace on up to this many producer/consumer pairs */
+            max_pairs = atoi(optarg);
+            if (max_pairs < 1 || max_pairs > MAXTHREADS / 2) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'j': /* Evaluate up to this many traces in parallel */
+            njobs = atoi(optarg);
+            if (njobs < 1) {
+                usage();
+                exit(1);
+            }
+            break;
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'c': /* Check the heap after every request */
+            heap_check = 1;
+            break;
+        case 'd': /* Compare deferred with immediate coalescing */
+            run_deferred = 1;
+            break;
+        case 'p': /* Compare the placement policies */
+            run_policies = 1;
+            break;
+        case 'F': /* Compare allocated blocks with and without a footer */
+            run_footers = 1;
+            break;
+        case 'L': /* Histogram the latency of each request */
+            latency = 1;
+            break;
+        case 'P': /* Sample the heap layout every this many requests */
+            profile = atoi(optarg);
+            if (profile < 1) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'o': /* File for the heap layout samples */
+            profile_file = optarg;
+            break;
+        case 'C': /* Free list classes and chunk sizes for mm_init */
+            read_classes(optarg, &classes);
+            if (mm_set_classes(&classes) < 0)
+		app_error("Invalid class table for mm_set_classes");
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -287,31 +452,145 @@ int main(int argc, char **argv)
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
 
+    /* Start the time series of heap layout samples */
+    if (profile)
+	write_profile_header();
+
     /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
-	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-	if (mm_stats[i].valid) {
-	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
-	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
-	    if (verbose > 1)
-		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
-	}
-	free_trace(trace);
-    }
+    eval_mm_traces(tracefiles, num_tracefiles, njobs, mm_stats);
 
     /* Display the mm results in a compact table */
     if (verbose) {
 	printf("\nResults for mm malloc:\n");
 	printresults(num_tracefiles, mm_stats);
 	printf("\n");
+	printf("Heap size for mm malloc:\n");
+	printheaps(num_tracefiles, mm_stats);
+	printf("\n");
+	printf("Realloc copies for mm malloc:\n");
+	printreallocs(num_tracefiles, mm_stats);
+	printf("\n");
+    }
+
+    /* Display the latency percentiles of each kind of request */
+    if (latency) {
+	printf("Request latency for mm malloc (cycles, p50/p99/p99.9):\n");
+	printlatency(num_tracefiles, mm_stats);
+	printf("\n");
+	printf("Request latency for mm malloc by size (cycles, p50/p99/p99.9):\n");
+	printlatclasses(num_tracefiles, mm_stats);
+	printf("\n");
+    }
+
+    /*
+     * Optionally evaluate the mm package again with deferred coalescing
+     */
+    if (run_deferred) {
+	if (verbose > 1)
+	    printf("\nTesting mm malloc with deferred coalescing\n");
+
+	deferred_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+	if (deferred_stats == NULL)
+	    unix_error("deferred_stats calloc in main failed");
+
+	/* The heap layout samples are of the immediate mode only */
+	saved_profile = profile;
+	profile = 0;
+	mm_set_deferred(1);
+	eval_mm_traces(tracefiles, num_tracefiles, njobs, deferred_stats);
+	mm_set_deferred(0);
+	profile = saved_profile;
+
+	printf("Immediate vs deferred coalescing for mm malloc:\n");
+	printdeferred(num_tracefiles, mm_stats, deferred_stats);
+	printf("\n");
+    }
+
+    /*
+     * Optionally evaluate the mm package again with a footer on every
+     * allocated block, as before the PA bit, to report what dropping it
+     * gains
+     */
+    if (run_footers) {
+	if (verbose > 1)
+	    printf("\nTesting mm malloc with footers on allocated blocks\n");
+
+	footer_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+	if (footer_stats == NULL)
+	    unix_error("footer_stats calloc in main failed");
+
+	saved_profile = profile;
+	profile = 0;
+	mm_set_footers(1);
+	eval_mm_traces(tracefiles, num_tracefiles, njobs, footer_stats);
+	mm_set_footers(0);
+	profile = saved_profile;
+
+	printf("Utilization gain from dropping the footer of allocated blocks:\n");
+	printfooters(num_tracefiles, mm_stats, footer_stats);
+	printf("\n");
+    }
+
+    /*
+     * Optionally evaluate the mm package again with the other placement
+     * policies, the runs above used best fit
+     */
+    if (run_policies) {
+	policy_stats[MM_BEST_FIT] = mm_stats;
+	saved_profile = profile;
+	profile = 0;
+	for (j = 0; j < NPOLICIES; j++) {
+	    if (j == MM_BEST_FIT)
+		continue;
+	    if (verbose > 1)
+		printf("\nTesting mm malloc with %s\n", policy_names[j]);
+
+	    policy_stats[j] = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+	    if (policy_stats[j] == NULL)
+		unix_error("policy_stats calloc in main failed");
+
+	    mm_set_policy(j);
+	    eval_mm_traces(tracefiles, num_tracefiles, njobs, policy_stats[j]);
+	}
+	mm_set_policy(MM_BEST_FIT);
+	profile = saved_profile;
+
+	printf("Placement policies for mm malloc:\n");
+	printpolicies(num_tracefiles, policy_stats);
+	printf("\n");
+    }
+
+    /*
+     * Optionally replay copies of each trace on a growing number of threads
+     */
+    if (max_threads) {
+	nconfigs = scaling_counts(max_threads, nthreads);
+	if (verbose > 1)
+	    printf("\nTesting mm malloc with up to %d threads\n", max_threads);
+	thread_secs = eval_mm_scaling(tracefiles, num_tracefiles, mm_stats,
+				      nconfigs, nthreads, eval_mm_threads);
+
+	printf("\nResults for mm malloc on multiple threads (aggregate Kops):\n");
+	printthreads(num_tracefiles, mm_stats, nconfigs, nthreads, thread_secs, 'T');
+	printf("\n");
+	free(thread_secs);
+    }
+
+    /*
+     * Optionally replay each trace with its allocations on producer
+     * threads and its frees on consumer threads
+     */
+    if (max_pairs) {
+	nconfigs = scaling_counts(max_pairs, nthreads);
+	if (verbose > 1)
+	    printf("\nTesting mm malloc with up to %d producer/consumer pairs\n", max_pairs);
+	thread_secs = eval_mm_scaling(tracefiles, num_tracefiles, mm_stats,
+				      nconfigs, nthreads, eval_mm_pairs);
+
+	printf("\nResults for mm malloc on producer/consumer pairs (aggregate Kops):\n");
+	printthreads(num_tracefiles, mm_stats, nconfigs, nthreads, thread_secs, 'P');
+	printf("\n");
+	free(thread_secs);
     }
 
     /* 
@@ -360,6 +639,7 @@ int main(int argc, char **argv)
     if (autograder) {
 	printf("correct:%d\n", numcorrect);
 	printf("perfidx:%.0f\n", perfindex);
+	printf("score:%.3f\n", perfindex); /* unrounded, to compare configurations */
     }
 
     exit(0);
@@ -367,11 +647,18 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks. It is an
+ * AVL tree, so every operation takes O(log n) for n live blocks.
  ****************************************************************/
 
+/* Height of a subtree, an empty one has height 0 */
+#define RANGE_HEIGHT(p) ((p) ? (p)->height : 0)
+#define RANGE_FIX_HEIGHT(p) ((p)->height = 1 + \
+    ((RANGE_HEIGHT((p)->left) > RANGE_HEIGHT((p)->right)) ? \
+     RANGE_HEIGHT((p)->left) : RANGE_HEIGHT((p)->right)))
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
@@ -382,7 +669,7 @@ static int add_range(range_t **ranges, char *lo, int size,
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *q;
     char msg[MAXLINE];
 
     assert(size > 0);
@@ -395,36 +682,49 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or of one
+     * region the mm package mapped with mem_map */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_mapping(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    /* 
+     * The payload must not overlap any other payloads. Only the payload
+     * with the highest lo at or below hi can reach into this one.
+     */
+    q = NULL;
+    for (p = *ranges;  p != NULL; ) {
+	if (p->lo <= hi) {
+	    q = p;
+	    p = p->right;
+	}
+	else
+	    p = p->left;
+    }
+    if (q != NULL && q->hi >= lo) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, q->lo, q->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
 	unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    p->left = NULL;
+    p->right = NULL;
+    p->height = 1;
+    *ranges = range_insert(*ranges, p);
     return 1;
 }
 
@@ -432,35 +732,238 @@ static int add_range(range_t **ranges, char *lo, int size,
  * remove_range - Free the range record of block whose payload starts at lo 
  */
 static void remove_range(range_t **ranges, char *lo)
+{
+    *ranges = range_delete(*ranges, lo);
+}
+
+/*
+ * clear_ranges - free all of the range records for a trace 
+ */
+static void clear_ranges(range_t **ranges)
+{
+    range_t *p = *ranges;
+
+    if (p == NULL)
+	return;
+    clear_ranges(&p->left);
+    clear_ranges(&p->right);
+    free(p);
+    *ranges = NULL;
+}
+
+/*
+ * range_insert - add range p to the subtree at root, and return the
+ *     new root of the subtree
+ */
+static range_t *range_insert(range_t *root, range_t *p)
+{
+    if (root == NULL)
+	return p;
+    if (p->lo < root->lo)
+	root->left = range_insert(root->left, p);
+    else
+	root->right = range_insert(root->right, p);
+    return range_balance(root);
+}
+
+/*
+ * range_delete - free the range starting at lo in the subtree at root, 
+ *     if there is one, and return the new root of the subtree
+ */
+static range_t *range_delete(range_t *root, char *lo)
 {
     range_t *p;
-    range_t **prevpp = ranges;
-    int size;
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+    if (root == NULL)
+	return NULL;
+    if (lo < root->lo)
+	root->left = range_delete(root->left, lo);
+    else if (lo > root->lo)
+	root->right = range_delete(root->right, lo);
+    else {
+	/* Replace the node by its successor, the leftmost right descendant */
+	p = root;
+	if (p->right == NULL)
+	    root = p->left;
+	else if (p->left == NULL)
+	    root = p->right;
+	else {
+	    for (root = p->right; root->left != NULL; root = root->left)
+		;
+	    root->right = range_delete_min(p->right);
+	    root->left = p->left;
+	}
+	free(p);
+	if (root == NULL)
+	    return NULL;
     }
+    return range_balance(root);
 }
 
 /*
- * clear_ranges - free all of the range records for a trace 
+ * range_delete_min - unlink the leftmost node of the subtree at root, 
+ *     without freeing it, and return the new root of the subtree
  */
-static void clear_ranges(range_t **ranges)
+static range_t *range_delete_min(range_t *root)
+{
+    if (root->left == NULL)
+	return root->right;
+    root->left = range_delete_min(root->left);
+    return range_balance(root);
+}
+
+/*
+ * range_balance - restore the AVL balance of the subtree at root after
+ *     one insert or delete below it, and return the new root
+ */
+static range_t *range_balance(range_t *root)
 {
     range_t *p;
-    range_t *pnext;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+    RANGE_FIX_HEIGHT(root);
+    if (RANGE_HEIGHT(root->left) > RANGE_HEIGHT(root->right) + 1) {
+	/* Rotate right, after rotating a right-heavy left child left */
+	p = root->left;
+	if (RANGE_HEIGHT(p->right) > RANGE_HEIGHT(p->left)) {
+	    root->left = p->right;
+	    p->right = root->left->left;
+	    root->left->left = p;
+	    RANGE_FIX_HEIGHT(p);
+	    p = root->left;
+	}
+	root->left = p->right;
+	p->right = root;
+	RANGE_FIX_HEIGHT(root);
+	RANGE_FIX_HEIGHT(p);
+	return p;
     }
-    *ranges = NULL;
+    if (RANGE_HEIGHT(root->right) > RANGE_HEIGHT(root->left) + 1) {
+	/* Rotate left, after rotating a left-heavy right child right */
+	p = root->right;
+	if (RANGE_HEIGHT(p->left) > RANGE_HEIGHT(p->right)) {
+	    root->right = p->left;
+	    p->left = root->right->right;
+	    root->right->right = p;
+	    RANGE_FIX_HEIGHT(p);
+	    p = root->right;
+	}
+	root->right = p->left;
+	p->left = root;
+	RANGE_FIX_HEIGHT(root);
+	RANGE_FIX_HEIGHT(p);
+	return p;
+    }
+    return root;
+}
+
+
+/*****************************************************************
+ * The following routines build and read the latency histograms. 
+ * Bucket b counts the requests whose cycle count has its top bits
+ * in b: each power of two is split into 1<<LAT_SUBBITS equal parts,
+ * so a percentile is off by at most 1/(1<<LAT_SUBBITS) of its value.
+ ****************************************************************/
+
+/*
+ * read_tsc - read the time stamp counter, or the nanosecond clock 
+ *     where there is no such counter
+ */
+static inline unsigned long long read_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned hi, lo;
+
+    asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((unsigned long long)hi << 32) | lo;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * lat_bucket - return the histogram bucket of a cycle count
+ */
+static int lat_bucket(unsigned long long cycles)
+{
+    int msb, bucket;
+
+    if (cycles < (1ULL << LAT_SUBBITS))
+	return (int)cycles;
+    msb = 63 - __builtin_clzll(cycles);
+    bucket = ((msb - LAT_SUBBITS + 1) << LAT_SUBBITS) + 
+	(int)((cycles >> (msb - LAT_SUBBITS)) & ((1 << LAT_SUBBITS) - 1));
+    return (bucket < LAT_BUCKETS) ? bucket : LAT_BUCKETS - 1;
+}
+
+/*
+ * lat_value - return the highest cycle count in a histogram bucket
+ */
+static unsigned long long lat_value(int bucket)
+{
+    int shift = (bucket >> LAT_SUBBITS) - 1;
+    unsigned long long lo;
+
+    if (bucket < (1 << LAT_SUBBITS))
+	return bucket;
+    lo = (unsigned long long)((1 << LAT_SUBBITS) + 
+			      (bucket & ((1 << LAT_SUBBITS) - 1))) << shift;
+    return lo + (1ULL << shift) - 1;
+}
+
+/*
+ * lat_class - return the size class of a request: <=16, <=32, ... 
+ */
+static int lat_class(size_t size)
+{
+    int class = 0;
+
+    while (class < LAT_CLASSES - 1 && size > ((size_t)16 << class))
+	class++;
+    return class;
+}
+
+/*
+ * lat_merge - add one trace's histogram for op (or every op if op < 0)
+ *     and size class (or every class if class < 0) into hist
+ */
+static void lat_merge(unsigned *hist, stats_t *stats, int op, int class)
+{
+    int o, c, b;
+
+    for (o = 0; o < LAT_OPS; o++) {
+	if (op >= 0 && o != op)
+	    continue;
+	for (c = 0; c < LAT_CLASSES; c++) {
+	    if (class >= 0 && c != class)
+		continue;
+	    for (b = 0; b < LAT_BUCKETS; b++)
+		hist[b] += stats->lat[o][c][b];
+	}
+    }
+}
+
+/*
+ * lat_percentile - return the cycle count that a fraction q of the 
+ *     requests in hist did not exceed, or -1 if hist is empty
+ */
+static double lat_percentile(unsigned *hist, double q)
+{
+    double total = 0, seen = 0;
+    int b;
+
+    for (b = 0; b < LAT_BUCKETS; b++)
+	total += hist[b];
+    if (total == 0)
+	return -1;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+	seen += hist[b];
+	if (seen >= q * total)
+	    break;
+    }
+    return (double)lat_value(b < LAT_BUCKETS ? b : LAT_BUCKETS - 1);
 }
 
 
@@ -469,7 +972,69 @@ static void clear_ranges(range_t **ranges)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * map_trace - map a binary trace file and point the request array 
+ *     into it. Returns 0 if the file is not a binary trace.
+ */
+static int map_trace(trace_t *trace, char *path)
+{
+    int fd;
+    struct stat st;
+    trace_header_t *header;
+    traceop_t *ops;
+    int i;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+	sprintf(msg, "Could not open %s in read_trace", path);
+	unix_error(msg);
+    }
+    if (fstat(fd, &st) < 0)
+	unix_error("fstat failed in map_trace");
+    if (st.st_size < sizeof(trace_header_t)) {
+	close(fd);
+	return 0;
+    }
+    header = (trace_header_t *)mmap(NULL, st.st_size, PROT_READ, 
+				    MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+	unix_error("mmap failed in map_trace");
+    if (header->magic != TRACE_MAGIC) {
+	munmap(header, st.st_size);
+	return 0;
+    }
+
+    /* The header and the records are all there is */
+    if ((header->version != TRACE_VERSION) || (header->num_ops < 0) ||
+	(header->num_ids < 0) ||
+	(st.st_size != sizeof(trace_header_t) + 
+	 (size_t)header->num_ops * sizeof(traceop_t))) {
+	printf("Bogus binary tracefile %s\n", path);
+	exit(1);
+    }
+
+    /* Every record indexes the blocks array, check them all once here */
+    ops = (traceop_t *)(header + 1);
+    for (i = 0; i < header->num_ops; i++) {
+	if (ops[i].index >= (unsigned)header->num_ids) {
+	    printf("Bogus block index %u in record %d of binary tracefile %s\n",
+		   (unsigned)ops[i].index, i, path);
+	    exit(1);
+	}
+    }
+
+    trace->sugg_heapsize = header->sugg_heapsize;
+    trace->num_ids = header->num_ids;
+    trace->num_ops = header->num_ops;
+    trace->weight = header->weight;
+    trace->ops = ops;
+    trace->map = header;
+    trace->map_len = st.st_size;
+    return 1;
+}
+
+/*
+ * read_trace - read a trace file and store it in memory. A binary
+ *     trace made by rep2bin is mapped instead.
  */
 static trace_t *read_trace(char *tracedir, char *filename)
 {
@@ -477,7 +1042,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
+    unsigned index, size, align;
     unsigned max_index = 0;
     unsigned op_index;
 
@@ -487,10 +1052,24 @@ static trace_t *read_trace(char *tracedir, char *filename)
     /* Allocate the trace record */
     if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
 	unix_error("malloc 1 failed in read_trance");
+    trace->map = NULL;
+    trace->map_len = 0;
 	
-    /* Read the trace file header */
     strcpy(path, tracedir);
     strcat(path, filename);
+
+    /* A binary trace needs only the two arrays the driver fills in */
+    if (map_trace(trace, path)) {
+	if ((trace->blocks = 
+	     (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+	    unix_error("malloc 3 failed in read_trace");
+	if ((trace->block_sizes = 
+	     (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	    unix_error("malloc 4 failed in read_trace");
+	return trace;
+    }
+
+    /* Read the trace file header */
     if ((tracefile = fopen(path, "r")) == NULL) {
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
@@ -534,6 +1113,21 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	    trace->ops[op_index].size = size;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
+	case 'c':
+	    fscanf(tracefile, "%u %u", &index, &size);
+	    trace->ops[op_index].type = CALLOC;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'm':
+	    fscanf(tracefile, "%u %u %u", &index, &align, &size);
+	    trace->ops[op_index].type = MEMALIGN;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].align = align;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
 	case 'f':
 	    fscanf(tracefile, "%ud", &index);
 	    trace->ops[op_index].type = FREE;
@@ -560,7 +1154,10 @@ static trace_t *read_trace(char *tracedir, char *filename)
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    if (trace->map != NULL)   /* unmap a binary trace, or free */
+	munmap(trace->map, trace->map_len);
+    else
+	free(trace->ops);     /* free the three arrays... */
     free(trace->blocks);      
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
@@ -571,6 +1168,127 @@ void free_trace(trace_t *trace)
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * eval_mm_trace - Evaluate the correctness, space utilization, and
+ *     speed of the mm malloc package on one trace file
+ */
+static void eval_mm_trace(char *filename, int tracenum, stats_t *stats)
+{
+    trace_t *trace;
+    range_t *ranges = NULL;
+    speed_t speed_params;
+
+    trace = read_trace(tracedir, filename);
+    stats->ops = trace->num_ops;
+    if (verbose > 1)
+	printf("Checking mm_malloc for correctness, ");
+    stats->valid = eval_mm_valid(trace, tracenum, &ranges);
+    if (stats->valid) {
+	if (verbose > 1)
+	    printf("efficiency, ");
+	stats->util = eval_mm_util(trace, tracenum, &ranges, stats);
+	stats->peak_heap = mem_peak_heapsize();
+	stats->final_heap = mem_heapsize() + mem_mapsize();
+	stats->resident_heap = mem_heap_resident();
+	speed_params.trace = trace;
+	speed_params.ranges = ranges;
+	if (verbose > 1)
+	    printf("and performance.\n");
+	stats->secs = fsecs(eval_mm_speed, &speed_params);
+	if (latency)
+	    eval_mm_latency(trace, stats);
+	if (profile)
+	    eval_mm_profile(trace, tracenum);
+    }
+    clear_ranges(&ranges);
+    free_trace(trace);
+}
+
+/*
+ * eval_mm_traces - Evaluate the traces one after another, or in up to
+ *     njobs forked workers if njobs is set
+ */
+static void eval_mm_traces(char **tracefiles, int n, int njobs, stats_t *stats)
+{
+    int i;
+
+    if (njobs)
+	eval_mm_jobs(tracefiles, n, njobs, stats);
+    else {
+	for (i = 0; i < n; i++)
+	    eval_mm_trace(tracefiles[i], i, &stats[i]);
+    }
+}
+
+/*
+ * eval_mm_jobs - Evaluate the traces in up to njobs forked workers at
+ *     once. Each worker has a private copy of the memlib heap, and
+ *     sends the stats of its trace and its error count back over a
+ *     pipe. The run times are only comparable to a sequential run when
+ *     there is a free CPU for every worker.
+ */
+static void eval_mm_jobs(char **tracefiles, int n, int njobs, stats_t *stats)
+{
+    pid_t *pids;
+    int *fds;
+    int fd[2];
+    int i, next = 0, running = 0;
+    int status, worker_errors;
+    pid_t pid;
+
+    if ((pids = (pid_t *)calloc(n, sizeof(pid_t))) == NULL ||
+	(fds = (int *)calloc(n, sizeof(int))) == NULL)
+	unix_error("calloc failed in eval_mm_jobs");
+
+    while (next < n || running > 0) {
+	/* Start a worker for the next trace while there is a free slot */
+	if (next < n && running < njobs) {
+	    if (pipe(fd) < 0)
+		unix_error("pipe failed in eval_mm_jobs");
+	    fflush(stdout);
+	    if ((pid = fork()) < 0)
+		unix_error("fork failed in eval_mm_jobs");
+	    if (pid == 0) {
+		close(fd[0]);
+		errors = 0; /* count only this trace's errors */
+		eval_mm_trace(tracefiles[next], next, &stats[next]);
+		fflush(stdout);
+		if (write(fd[1], &stats[next], sizeof(stats_t)) != sizeof(stats_t) ||
+		    write(fd[1], &errors, sizeof(int)) != sizeof(int))
+		    _exit(1);
+		_exit(0);
+	    }
+	    close(fd[1]);
+	    pids[next] = pid;
+	    fds[next] = fd[0];
+	    next++;
+	    running++;
+	    continue;
+	}
+
+	/* Collect the results of the next worker to finish */
+	if ((pid = wait(&status)) < 0)
+	    unix_error("wait failed in eval_mm_jobs");
+	for (i = 0; i < next && pids[i] != pid; i++)
+	    ;
+	if (i == next)
+	    continue;
+	running--;
+	if (read(fds[i], &stats[i], sizeof(stats_t)) != sizeof(stats_t) ||
+	    read(fds[i], &worker_errors, sizeof(int)) != sizeof(int)) {
+	    /* The worker died, e.g. on a segfault in mm.c */
+	    memset(&stats[i], 0, sizeof(stats_t));
+	    worker_errors = 1;
+	    printf("ERROR [trace %d]: worker exited with status 0x%x\n", 
+		   i, status);
+	}
+	errors += worker_errors;
+	close(fds[i]);
+    }
+    free(pids);
+    free(fds);
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
@@ -584,8 +1302,11 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     char *oldp;
     char *p;
     
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range list. The
+     * released pages read as zero, as a new heap's would, so that
+     * mm_calloc gets to hand them out without clearing them. */
     mem_reset_brk();
+    mem_release(mem_heap_lo(), MAX_HEAP);
     clear_ranges(ranges);
 
     /* Call the mm package's init function */
@@ -602,10 +1323,14 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
 
 	    /* Call the student's malloc */
-	    if ((p = mm_malloc(size)) == NULL) {
-		malloc_error(tracenum, i, "mm_malloc failed.");
+	    if ((p = mm_alloc(&trace->ops[i])) == NULL) {
+		malloc_error(tracenum, i, (trace->ops[i].type == MEMALIGN) ?
+			     "mm_memalign failed." : (trace->ops[i].type == CALLOC) ?
+			     "mm_calloc failed." : "mm_malloc failed.");
 		return 0;
 	    }
 	    
@@ -616,6 +1341,24 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	     */ 
 	    if (add_range(ranges, p, size, tracenum, i) == 0)
 		return 0;
+
+	    /* A memalign request must be aligned to its own alignment too */
+	    if (trace->ops[i].type == MEMALIGN && trace->ops[i].align > 0 &&
+		((unsigned long)p % trace->ops[i].align) != 0) {
+		malloc_error(tracenum, i, "mm_memalign returned a misaligned block");
+		return 0;
+	    }
+
+	    /* And a calloc request must read as zero */
+	    if (trace->ops[i].type == CALLOC) {
+		for (j = 0; j < size; j++) {
+		    if (p[j] != 0) {
+			malloc_error(tracenum, i, "mm_calloc returned a block "
+				     "that is not zero");
+			return 0;
+		    }
+		}
+	    }
 	    
 	    /* ADDED: cgw
 	     * fill range with low byte of index.  This will be used later
@@ -653,7 +1396,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -678,6 +1421,11 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
 
+	/* Optionally let the mm package check its whole heap */
+	if (heap_check && mm_check(MM_CHECK_PARANOID) != 0) {
+	    malloc_error(tracenum, i, "mm_check found an inconsistent heap.");
+	    return 0;
+	}
     }
 
     /* As far as we know, this is a valid malloc package */
@@ -689,24 +1437,29 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   peak size of the heap in bytes while running the student's malloc 
+ *   package on the trace. Since mem_sbrk() lets the students decrement
+ *   the brk pointer, the heap may end up smaller than its peak.
+ *   It also counts how many payload bytes the reallocs had to move.
  *   
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   stats_t *stats)
 {   
     int i;
     int index;
     int size, newsize, oldsize;
-    int max_total_size = 0;
-    int total_size = 0;
+    int remapped;
+    long max_total_size = 0;
+    long total_size = 0;
     char *p;
     char *newp, *oldp;
 
-    /* initialize the heap and the mm malloc package */
+    /* initialize the heap and the mm malloc package, dropping the pages
+     * earlier runs left behind so that the resident size counts only
+     * this trace */
     mem_reset_brk();
+    mem_release(mem_heap_lo(), MAX_HEAP);
     if (mm_init() < 0)
 	app_error("mm_init failed in eval_mm_util");
 
@@ -714,10 +1467,12 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
 	    index = trace->ops[i].index;
 	    size = trace->ops[i].size;
 
-	    if ((p = mm_malloc(size)) == NULL) 
+	    if ((p = mm_alloc(&trace->ops[i])) == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
 	    
 	    /* Remember region and size */
@@ -739,9 +1494,22 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 
 	    oldp = trace->blocks[index];
+	    remapped = mem_mapping(oldp, oldp);
 	    if ((newp = mm_realloc(oldp,newsize)) == NULL)
 		app_error("mm_realloc failed in eval_mm_util");
 
+	    /* Count the bytes a copying realloc moved or an in place one
+	     * saved. A mapped block that moved to another mapping was
+	     * remapped, its pages moved without a copy. */
+	    remapped = remapped && mem_mapping(newp, newp);
+	    stats->reallocs++;
+	    if (newp == oldp || remapped) {
+		stats->inplace++;
+		stats->avoided += (newsize < oldsize) ? newsize : oldsize;
+	    }
+	    else
+		stats->copied += (newsize < oldsize) ? newsize : oldsize;
+
 	    /* Remember region and size */
 	    trace->blocks[index] = newp;
 	    trace->block_sizes[index] = newsize;
@@ -774,7 +1542,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_peak_heapsize());
 }
 
 
@@ -784,7 +1552,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index, size, newsize;
+    int i, index, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
@@ -798,9 +1566,10 @@ static void eval_mm_speed(void *ptr)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
             index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
+            if ((p = mm_alloc(&trace->ops[i])) == NULL)
 		app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
             break;
@@ -826,24 +1595,511 @@ static void eval_mm_speed(void *ptr)
 }
 
 /*
- * eval_libc_valid - We run this function to make sure that the
- *    libc malloc can run to completion on the set of traces.
- *    We'll be conservative and terminate if any libc malloc call fails.
- *
+ * eval_mm_latency - Replay the trace once more and count the cycles of
+ *    each request in the histogram for its type and size class. This is
+ *    a separate pass, so that reading the cycle counter does not slow
+ *    down the run that eval_mm_speed times. A free is counted in the
+ *    size class of the block it frees.
  */
-static int eval_libc_valid(trace_t *trace, int tracenum)
+static void eval_mm_latency(trace_t *trace, stats_t *stats)
 {
-    int i, newsize;
-    char *p, *newp, *oldp;
+    int i, index, size, type;
+    char *p;
+    unsigned long long start, cycles, overhead = ~0ULL;
+
+    /* The least cycles between two reads of the counter */
+    for (i = 0; i < 100; i++) {
+	start = read_tsc();
+	cycles = read_tsc() - start;
+	if (cycles < overhead)
+	    overhead = cycles;
+    }
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_latency");
 
+    /* Interpret and time each trace request */
     for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+	type = trace->ops[i].type;
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+        switch (type) {
 
-        case ALLOC: /* malloc */
-	    if ((p = malloc(trace->ops[i].size)) == NULL) {
-		malloc_error(tracenum, i, "libc malloc failed");
-		unix_error("System message");
-	    }
+        case ALLOC: /* mm_malloc */
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
+	    start = read_tsc();
+            p = mm_alloc(&trace->ops[i]);
+	    cycles = read_tsc() - start;
+            if (p == NULL)
+		app_error("mm_malloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+            break;
+
+	case REALLOC: /* mm_realloc */
+	    start = read_tsc();
+            p = mm_realloc(trace->blocks[index], size);
+	    cycles = read_tsc() - start;
+            if (p == NULL)
+		app_error("mm_realloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+            break;
+
+        case FREE: /* mm_free */
+	    size = trace->block_sizes[index];
+	    start = read_tsc();
+            mm_free(trace->blocks[index]);
+	    cycles = read_tsc() - start;
+            break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_latency");
+	    return;
+        }
+	cycles = (cycles > overhead) ? cycles - overhead : 0;
+	stats->lat[type][lat_class(size)][lat_bucket(cycles)]++;
+    }
+}
+
+/*
+ * write_profile_header - Create the profile file and write the column
+ *    names of eval_mm_profile's samples. An empty heap tells how many
+ *    free list classes the mm package has.
+ */
+static void write_profile_header(void)
+{
+    FILE *fp;
+    mm_heap_info_t info;
+    int i;
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in write_profile_header");
+    mm_heap_info(&info);
+
+    if ((fp = fopen(profile_file, "w")) == NULL) {
+	sprintf(msg, "Could not create %s in write_profile_header", profile_file);
+	unix_error(msg);
+    }
+    fprintf(fp, "trace\top\theap\talloc_blocks\talloc_bytes\tpayload"
+	    "\tpadding_per_block\tfree_blocks\tfree_bytes\tlargest_free\text_frag");
+    for (i = 4; i < MM_SIZE_BINS; i++)
+	fprintf(fp, "\tfree_%lu", 1UL << i);
+    for (i = 0; i < info.nclasses; i++)
+	fprintf(fp, "\tclass_%d", i);
+    fprintf(fp, "\n");
+    fclose(fp);
+}
+
+/*
+ * eval_mm_profile - Replay the trace once more and append a sample of
+ *    the heap layout to the profile file every profile requests, and
+ *    after the last one. The padding of the allocated blocks is their
+ *    size less the payload that the trace asked for, so it counts the
+ *    headers, the rounding, realloc slack and unused slab slots.
+ *    Each sample is a single line written in append mode, so that the
+ *    workers of -j can share the file.
+ */
+static void eval_mm_profile(trace_t *trace, int tracenum)
+{
+    int i, index, size;
+    char *p;
+    FILE *fp;
+    mm_heap_info_t info;
+    double payload = 0;
+    int b;
+
+    if ((fp = fopen(profile_file, "a")) == NULL) {
+	sprintf(msg, "Could not open %s in eval_mm_profile", profile_file);
+	unix_error(msg);
+    }
+    setvbuf(fp, NULL, _IOLBF, 0);
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_profile");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
+            if ((p = mm_alloc(&trace->ops[i])) == NULL)
+		app_error("mm_malloc error in eval_mm_profile");
+            trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    payload += size;
+            break;
+
+	case REALLOC: /* mm_realloc */
+            if ((p = mm_realloc(trace->blocks[index], size)) == NULL)
+		app_error("mm_realloc error in eval_mm_profile");
+            trace->blocks[index] = p;
+	    payload += size - (double)trace->block_sizes[index];
+	    trace->block_sizes[index] = size;
+            break;
+
+        case FREE: /* mm_free */
+            mm_free(trace->blocks[index]);
+	    payload -= trace->block_sizes[index];
+            break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_profile");
+        }
+
+	/* Sample the heap */
+	if ((i + 1) % profile != 0 && i != trace->num_ops - 1)
+	    continue;
+	mm_heap_info(&info);
+	fprintf(fp, "%d\t%d\t%lu\t%lu\t%lu\t%.0f\t%.2f\t%lu\t%lu\t%lu\t%.4f",
+		tracenum, i + 1,
+		(unsigned long)info.heap_bytes,
+		(unsigned long)info.alloc_blocks,
+		(unsigned long)info.alloc_bytes,
+		payload,
+		info.alloc_blocks ? (info.alloc_bytes - payload) / info.alloc_blocks : 0.0,
+		(unsigned long)info.free_blocks,
+		(unsigned long)info.free_bytes,
+		(unsigned long)info.largest_free,
+		info.free_bytes ? 1.0 - (double)info.largest_free / info.free_bytes : 0.0);
+	for (b = 4; b < MM_SIZE_BINS; b++)
+	    fprintf(fp, "\t%lu", (unsigned long)info.free_hist[b]);
+	for (b = 0; b < info.nclasses; b++)
+	    fprintf(fp, "\t%lu", (unsigned long)info.class_blocks[b]);
+	fprintf(fp, "\n");
+    }
+    fclose(fp);
+}
+
+/*
+ * eval_mm_scaling - Time the replays of each valid trace on every
+ *    thread count in counts with eval, eval_mm_threads or eval_mm_pairs.
+ *    Returns the run times, one row per trace, where zero marks a
+ *    replay that ran out of heap.
+ */
+static double *eval_mm_scaling(char **tracefiles, int n, stats_t *stats,
+			       int nconfigs, int *counts, void (*eval)(void *))
+{
+    speed_t speed_params;
+    trace_t *trace;
+    double *secs;
+    int i, j;
+
+    secs = (double *)calloc(n * nconfigs, sizeof(double));
+    if (secs == NULL)
+	unix_error("secs calloc in eval_mm_scaling failed");
+
+    mm_set_threaded(1);
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	trace = read_trace(tracedir, tracefiles[i]);
+	for (j = 0; j < nconfigs; j++) {
+	    speed_params.trace = trace;
+	    speed_params.nthreads = counts[j];
+	    speed_params.failed = 0;
+	    speed_params.blocks = (char **)malloc(counts[j] * 
+				   trace->num_ids * sizeof(char *));
+	    speed_params.sizes = (size_t *)malloc(counts[j] * 
+				   trace->num_ids * sizeof(size_t));
+	    if (speed_params.blocks == NULL || speed_params.sizes == NULL)
+		unix_error("malloc failed in eval_mm_scaling");
+	    secs[i*nconfigs + j] = fsecs(eval, &speed_params);
+	    if (__atomic_load_n(&speed_params.failed, __ATOMIC_RELAXED))
+		secs[i*nconfigs + j] = 0;
+	    free(speed_params.blocks);
+	    free(speed_params.sizes);
+	}
+	free_trace(trace);
+    }
+    mm_set_threaded(0);
+    return secs;
+}
+
+/*
+ * eval_mm_threads - This is the function that is used by fsecs() to
+ *    measure the running time of the mm malloc package when nthreads
+ *    threads each replay their own copy of the trace at the same time.
+ */
+static void eval_mm_threads(void *ptr)
+{
+    speed_t *speed = (speed_t *)ptr;
+    pthread_t tids[MAXTHREADS];
+    thread_t args[MAXTHREADS];
+    int i;
+
+    /* Don't repeat a replay that already ran out of heap */
+    if (__atomic_load_n(&speed->failed, __ATOMIC_RELAXED))
+	return;
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_threads");
+
+    for (i = 0; i < speed->nthreads; i++) {
+	args[i].speed = speed;
+	args[i].blocks = speed->blocks + i * speed->trace->num_ids;
+	if (pthread_create(&tids[i], NULL, eval_mm_thread, &args[i]) != 0)
+	    unix_error("pthread_create failed in eval_mm_threads");
+    }
+    for (i = 0; i < speed->nthreads; i++)
+	pthread_join(tids[i], NULL);
+}
+
+/*
+ * eval_mm_thread - Replay one copy of the trace on the calling thread.
+ *    Unlike eval_mm_speed, running out of heap is not fatal here, since
+ *    nthreads copies may not fit in MAX_HEAP.
+ */
+static void *eval_mm_thread(void *ptr)
+{
+    thread_t *arg = (thread_t *)ptr;
+    trace_t *trace = arg->speed->trace;
+    char **blocks = arg->blocks;
+    int i, index;
+    char *p;
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
+            if ((p = mm_alloc(&trace->ops[i])) == NULL) {
+		__atomic_store_n(&arg->speed->failed, 1, __ATOMIC_RELAXED);
+		return NULL;
+	    }
+            blocks[index] = p;
+            break;
+
+	case REALLOC: /* mm_realloc */
+            if ((p = mm_realloc(blocks[index], trace->ops[i].size)) == NULL) {
+		__atomic_store_n(&arg->speed->failed, 1, __ATOMIC_RELAXED);
+		return NULL;
+	    }
+            blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free */
+            mm_free(blocks[index]);
+            break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_thread");
+        }
+    }
+    return NULL;
+}
+
+/*
+ * eval_mm_pairs - This is the function that is used by fsecs() to
+ *    measure the running time of the mm malloc package when nthreads
+ *    pairs of threads replay their own copy of the trace. The producer
+ *    of a pair makes the allocations and reallocations, and hands the
+ *    blocks the trace frees to its consumer, which frees them.
+ */
+static void eval_mm_pairs(void *ptr)
+{
+    static ring_t rings[MAXTHREADS / 2];
+    speed_t *speed = (speed_t *)ptr;
+    pthread_t tids[MAXTHREADS];
+    thread_t args[MAXTHREADS];
+    int i;
+
+    /* Don't repeat a replay that already ran out of heap */
+    if (__atomic_load_n(&speed->failed, __ATOMIC_RELAXED))
+	return;
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_pairs");
+
+    for (i = 0; i < speed->nthreads; i++) {
+	rings[i].head = rings[i].tail = 0;
+	rings[i].freed = rings[i].passed = 0;
+	args[2*i].speed = args[2*i+1].speed = speed;
+	args[2*i].blocks = speed->blocks + i * speed->trace->num_ids;
+	args[2*i].sizes = speed->sizes + i * speed->trace->num_ids;
+	args[2*i+1].blocks = NULL;
+	args[2*i+1].sizes = NULL;
+	args[2*i].ring = args[2*i+1].ring = &rings[i];
+	if (pthread_create(&tids[2*i], NULL, eval_mm_producer, &args[2*i]) != 0 ||
+	    pthread_create(&tids[2*i+1], NULL, eval_mm_consumer, &args[2*i+1]) != 0)
+	    unix_error("pthread_create failed in eval_mm_pairs");
+    }
+    for (i = 0; i < 2 * speed->nthreads; i++)
+	pthread_join(tids[i], NULL);
+}
+
+/*
+ * eval_mm_producer - Replay the allocations and reallocations of the
+ *    trace, and pass the blocks it frees to the consumer. A NULL block
+ *    tells the consumer the replay is over, also when it ran out of heap.
+ *    Each allocation waits while the consumer has more than RING_BYTES
+ *    of the blocks passed before it left to free, so the consumer frees
+ *    while the producer allocates, and the heap holds at most that much
+ *    more than in the trace.
+ */
+static void *eval_mm_producer(void *ptr)
+{
+    thread_t *arg = (thread_t *)ptr;
+    trace_t *trace = arg->speed->trace;
+    char **blocks = arg->blocks;
+    size_t *sizes = arg->sizes;
+    int i, index;
+    char *p;
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
+	    ring_wait(arg->ring);
+            if ((p = mm_alloc(&trace->ops[i])) == NULL) {
+		__atomic_store_n(&arg->speed->failed, 1, __ATOMIC_RELAXED);
+		ring_put(arg->ring, NULL, 0);
+		return NULL;
+	    }
+            blocks[index] = p;
+            sizes[index] = trace->ops[i].size;
+            break;
+
+	case REALLOC: /* mm_realloc */
+	    ring_wait(arg->ring);
+            if ((p = mm_realloc(blocks[index], trace->ops[i].size)) == NULL) {
+		__atomic_store_n(&arg->speed->failed, 1, __ATOMIC_RELAXED);
+		ring_put(arg->ring, NULL, 0);
+		return NULL;
+	    }
+            blocks[index] = p;
+            sizes[index] = trace->ops[i].size;
+            break;
+
+        case FREE: /* mm_free, on the consumer */
+            ring_put(arg->ring, blocks[index], sizes[index]);
+            break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_producer");
+        }
+    }
+    ring_put(arg->ring, NULL, 0);
+    return NULL;
+}
+
+/*
+ * eval_mm_consumer - Free the blocks the producer passes, until it
+ *    passes NULL
+ */
+static void *eval_mm_consumer(void *ptr)
+{
+    thread_t *arg = (thread_t *)ptr;
+    char *p;
+
+    while ((p = ring_get(arg->ring)) != NULL) {
+	mm_free(p);
+	ring_done(arg->ring);
+    }
+    return NULL;
+}
+
+/*
+ * ring_put - Append a block of size payload bytes to the ring, waiting
+ *    while it is full
+ */
+static void ring_put(ring_t *ring, char *p, size_t size)
+{
+    unsigned long tail = ring->tail;
+
+    while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == RING_SLOTS)
+	sched_yield();
+    ring->slots[tail % RING_SLOTS] = p;
+    ring->sizes[tail % RING_SLOTS] = size;
+    ring->passed += size;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * ring_get - Return the oldest block on the ring, waiting while it is
+ *    empty. It stays on the ring until ring_done.
+ */
+static char *ring_get(ring_t *ring)
+{
+    unsigned long head = ring->head;
+
+    while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head)
+	sched_yield();
+    return ring->slots[head % RING_SLOTS];
+}
+
+/*
+ * ring_done - Take the oldest block off the ring, once it is freed
+ */
+static void ring_done(ring_t *ring)
+{
+    __atomic_store_n(&ring->freed, ring->freed + ring->sizes[ring->head % RING_SLOTS],
+		     __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * ring_wait - Wait while the blocks on the ring hold more than
+ *    RING_BYTES of payload
+ */
+static void ring_wait(ring_t *ring)
+{
+    while (ring->passed - __atomic_load_n(&ring->freed, __ATOMIC_ACQUIRE) > RING_BYTES)
+	sched_yield();
+}
+
+/*
+ * mm_alloc - Call mm_malloc, or mm_memalign or mm_calloc for the
+ *     requests of those
+ */
+static char *mm_alloc(traceop_t *op)
+{
+    if (op->type == MEMALIGN)
+	return mm_memalign(op->align, op->size);
+    if (op->type == CALLOC)
+	return mm_calloc(1, op->size);
+    return mm_malloc(op->size);
+}
+
+/*
+ * eval_libc_valid - We run this function to make sure that the
+ *    libc malloc can run to completion on the set of traces.
+ *    We'll be conservative and terminate if any libc malloc call fails.
+ *
+ */
+static int eval_libc_valid(trace_t *trace, int tracenum)
+{
+    int i, newsize;
+    char *p, *newp, *oldp;
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* malloc */
+        case MEMALIGN: /* posix_memalign */
+        case CALLOC: /* calloc */
+	    if ((p = libc_alloc(&trace->ops[i])) == NULL) {
+		malloc_error(tracenum, i, "libc malloc failed");
+		unix_error("System message");
+	    }
 	    trace->blocks[trace->ops[i].index] = p;
 	    break;
 
@@ -877,16 +2133,17 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 static void eval_libc_speed(void *ptr)
 {
     int i;
-    int index, size, newsize;
+    int index, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
         case ALLOC: /* malloc */
+        case MEMALIGN: /* posix_memalign */
+        case CALLOC: /* calloc */
 	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
-	    if ((p = malloc(size)) == NULL)
+	    if ((p = libc_alloc(&trace->ops[i])) == NULL)
 		unix_error("malloc failed in eval_libc_speed");
 	    trace->blocks[index] = p;
 	    break;
@@ -910,11 +2167,135 @@ static void eval_libc_speed(void *ptr)
     }
 }
 
+/*
+ * libc_alloc - Call malloc, or posix_memalign or calloc for the
+ *     requests of those
+ */
+static char *libc_alloc(traceop_t *op)
+{
+    void *p;
+
+    if (op->type == CALLOC)
+	return calloc(1, op->size);
+    if (op->type != MEMALIGN || op->align <= sizeof(void *))
+	return malloc(op->size);
+    if (posix_memalign(&p, op->align, op->size) != 0)
+	return NULL;
+    return p;
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
 
 
+/*
+ * printheaps - prints the peak, final and resident heap size of each
+ *     trace for the student's malloc package
+ */
+static void printheaps(int n, stats_t *stats) 
+{
+    int i;
+
+    printf("%5s%12s%12s%12s\n", "trace", "peak", "final", "resident");
+    for (i=0; i < n; i++) {
+	if (stats[i].valid)
+	    printf("%2d%15lu%12lu%12lu\n", i,
+		   (unsigned long)stats[i].peak_heap,
+		   (unsigned long)stats[i].final_heap,
+		   (unsigned long)stats[i].resident_heap);
+	else
+	    printf("%2d%15s%12s%12s\n", i, "-", "-", "-");
+    }
+}
+
+/*
+ * printreallocs - prints how many reallocs of each trace kept their 
+ *     block, and the payload bytes moved and not moved
+ */
+static void printreallocs(int n, stats_t *stats) 
+{
+    int i;
+
+    printf("%5s%10s%10s%12s%12s\n", 
+	   "trace", "reallocs", "in place", "copied", "avoided");
+    for (i=0; i < n; i++) {
+	if (stats[i].valid)
+	    printf("%2d%13.0f%10.0f%12.0f%12.0f\n", i, stats[i].reallocs,
+		   stats[i].inplace, stats[i].copied, stats[i].avoided);
+	else
+	    printf("%2d%13s%10s%12s%12s\n", i, "-", "-", "-", "-");
+    }
+}
+
+/*
+ * printlatency - prints the latency percentiles of the mallocs, frees,
+ *     reallocs, memaligns and callocs of each trace for the student's
+ *     malloc package
+ */
+static void printlatency(int n, stats_t *stats) 
+{
+    int i, j, op;
+    unsigned hist[LAT_BUCKETS];
+    char cell[MAXLINE];
+
+    printf("%5s%22s%22s%22s%22s%22s\n", "trace", "malloc", "free", "realloc", "memalign", "calloc");
+    for (i=0; i <= n; i++) {
+	if (i < n)
+	    printf("%2d   ", i);
+	else
+	    printf("%-5s", "Total");
+	for (op = 0; op < LAT_OPS; op++) {
+	    memset(hist, 0, sizeof(hist));
+	    for (j = 0; j < n; j++)
+		if ((i == n || i == j) && stats[j].valid)
+		    lat_merge(hist, &stats[j], op, -1);
+	    if (lat_percentile(hist, 0.5) < 0) {
+		printf("%22s", "-");
+		continue;
+	    }
+	    sprintf(cell, "%.0f/%.0f/%.0f", lat_percentile(hist, 0.5),
+		    lat_percentile(hist, 0.99), lat_percentile(hist, 0.999));
+	    printf("%22s", cell);
+	}
+	printf("\n");
+    }
+}
+
+/*
+ * printlatclasses - prints the latency percentiles of each size class
+ *     over all of the traces for the student's malloc package
+ */
+static void printlatclasses(int n, stats_t *stats) 
+{
+    int i, c, op;
+    unsigned hist[LAT_BUCKETS];
+    char cell[MAXLINE];
+
+    printf("%8s%22s%22s%22s%22s%22s\n", "size", "malloc", "free", "realloc", "memalign", "calloc");
+    for (c = 0; c < LAT_CLASSES; c++) {
+	if (c < LAT_CLASSES - 1)
+	    sprintf(cell, "<=%d", 16 << c);
+	else
+	    sprintf(cell, ">%d", 16 << (c - 1));
+	printf("%8s", cell);
+	for (op = 0; op < LAT_OPS; op++) {
+	    memset(hist, 0, sizeof(hist));
+	    for (i = 0; i < n; i++)
+		if (stats[i].valid)
+		    lat_merge(hist, &stats[i], op, c);
+	    if (lat_percentile(hist, 0.5) < 0) {
+		printf("%22s", "-");
+		continue;
+	    }
+	    sprintf(cell, "%.0f/%.0f/%.0f", lat_percentile(hist, 0.5),
+		    lat_percentile(hist, 0.99), lat_percentile(hist, 0.999));
+	    printf("%22s", cell);
+	}
+	printf("\n");
+    }
+}
+
 /*
  * printresults - prints a performance summary for some malloc package
  */
@@ -924,13 +2305,17 @@ static void printresults(int n, stats_t *stats)
     double secs = 0;
     double ops = 0;
     double util = 0;
+    unsigned hist[LAT_BUCKETS];
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n", 
+    printf("%5s%7s %5s%8s%10s%6s", 
 	   "trace", " valid", "util", "ops", "secs", "Kops");
+    if (latency)
+	printf("%8s%8s%8s", "p50", "p99", "p99.9");
+    printf("\n");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
@@ -942,7 +2327,7 @@ static void printresults(int n, stats_t *stats)
 	    util += stats[i].util;
 	}
 	else {
-	    printf("%2d%10s%6s%8s%10s%6s\n", 
+	    printf("%2d%10s%6s%8s%10s%6s", 
 		   i,
 		   "no",
 		   "-",
@@ -950,11 +2335,18 @@ static void printresults(int n, stats_t *stats)
 		   "-",
 		   "-");
 	}
+	if (latency) {
+	    memset(hist, 0, sizeof(hist));
+	    if (stats[i].valid)
+		lat_merge(hist, &stats[i], -1, -1);
+	    printlatcols(hist);
+	}
+	printf("\n");
     }
 
     /* Print the aggregate results for the set of traces */
     if (errors == 0) {
-	printf("%12s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	printf("%12s%5.0f%%%8.0f%10.6f%6.0f", 
 	       "Total       ",
 	       (util/n)*100.0,
 	       ops, 
@@ -962,14 +2354,294 @@ static void printresults(int n, stats_t *stats)
 	       (ops/1e3)/secs);
     }
     else {
-	printf("%12s%6s%8s%10s%6s\n", 
+	printf("%12s%6s%8s%10s%6s", 
 	       "Total       ",
 	       "-", 
 	       "-", 
 	       "-", 
 	       "-");
     }
+    if (latency) {
+	memset(hist, 0, sizeof(hist));
+	for (i=0; i < n; i++)
+	    if (stats[i].valid)
+		lat_merge(hist, &stats[i], -1, -1);
+	printlatcols(hist);
+    }
+    printf("\n");
+}
+
+/*
+ * printlatcols - prints the p50, p99 and p99.9 columns of a latency
+ *     histogram, or dashes if it is empty (as for libc malloc)
+ */
+static void printlatcols(unsigned *hist)
+{
+    if (lat_percentile(hist, 0.5) < 0)
+	printf("%8s%8s%8s", "-", "-", "-");
+    else
+	printf("%8.0f%8.0f%8.0f", lat_percentile(hist, 0.5),
+	       lat_percentile(hist, 0.99), lat_percentile(hist, 0.999));
+}
+
+/*
+ * scaling_counts - fills counts with the thread or pair counts 1, 2,
+ *     4, ... up to max, and returns how many there are
+ */
+static int scaling_counts(int max, int *counts)
+{
+    int j, n = 0;
+
+    for (j = 1; j < max; j *= 2)
+	counts[n++] = j;
+    counts[n++] = max;
+    return n;
+}
+
+/*
+ * printthreads - prints the aggregate throughput of the threaded
+ *     replays, one column per thread count, headed by the count and
+ *     unit, T for threads and P for producer/consumer pairs. A run
+ *     time of zero marks a replay that ran out of heap.
+ */
+static void printthreads(int n, stats_t *stats, int nconfigs, 
+			 int *nthreads, double *secs, char unit)
+{
+    int i, j, k, valid = 0;
+    double ops, total;
+
+    printf("%5s", "trace");
+    for (j = 0; j < nconfigs; j++)
+	printf("%7d%c", nthreads[j], unit);
+    printf("\n");
+
+    for (i = 0; i < n; i++) {
+	printf("%2d   ", i);
+	for (j = 0; j < nconfigs; j++) {
+	    if (stats[i].valid && secs[i*nconfigs + j] > 0)
+		printf("%8.0f", 
+		       (nthreads[j] * stats[i].ops / 1e3) / secs[i*nconfigs + j]);
+	    else
+		printf("%8s", "-");
+	}
+	printf("\n");
+    }
+
+    /* 
+     * Aggregate over the traces that every thread count completed, so
+     * that all columns sum the same traces
+     */
+    printf("%5s", "Total");
+    for (j = 0; j < nconfigs; j++) {
+	ops = 0;
+	total = 0;
+	valid = 0;
+	for (i = 0; i < n; i++) {
+	    for (k = 0; k < nconfigs; k++)
+		if (!stats[i].valid || secs[i*nconfigs + k] <= 0)
+		    break;
+	    if (k < nconfigs)
+		continue;
+	    ops += nthreads[j] * stats[i].ops;
+	    total += secs[i*nconfigs + j];
+	    valid++;
+	}
+	if (valid > 0)
+	    printf("%8.0f", (ops / 1e3) / total);
+	else
+	    printf("%8s", "-");
+    }
+    printf("\n");
+    if (valid < n)
+	printf("(Total of the %d traces out of %d that every %s count completed)\n",
+	       valid, n, (unit == 'T') ? "thread" : "pair");
+
+    /* Name each replay that ran out of heap */
+    for (i = 0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	for (j = 0; j < nconfigs; j++)
+	    if (secs[i*nconfigs + j] <= 0)
+		break;
+	if (j == nconfigs)
+	    continue;
+	printf("Trace %d ran out of heap on", i);
+	for (; j < nconfigs; j++)
+	    if (secs[i*nconfigs + j] <= 0)
+		printf(" %d%c", nthreads[j], unit);
+	printf("\n");
+    }
+}
+
+/*
+ * printpolicies - prints the utilization and throughput of each trace
+ *     with each placement policy
+ */
+static void printpolicies(int n, stats_t **policy_stats)
+{
+    int i, j, valid = 0;
+    double util[NPOLICIES], secs[NPOLICIES], ops = 0;
+
+    printf("%5s", "trace");
+    for (j = 0; j < NPOLICIES; j++) {
+	printf("%8s%8s", policy_tags[j], "Kops");
+	util[j] = secs[j] = 0;
+    }
+    printf("\n");
+    for (i = 0; i < n; i++) {
+	for (j = 0; j < NPOLICIES; j++)
+	    if (!policy_stats[j][i].valid)
+		break;
+	printf("%2d%3s", i, "");
+	if (j < NPOLICIES) {
+	    for (j = 0; j < NPOLICIES; j++)
+		printf("%8s%8s", "-", "-");
+	    printf("\n");
+	    continue;
+	}
+	for (j = 0; j < NPOLICIES; j++) {
+	    printf("%7.0f%%%8.0f", policy_stats[j][i].util*100.0,
+		   (policy_stats[j][i].ops/1e3)/policy_stats[j][i].secs);
+	    util[j] += policy_stats[j][i].util;
+	    secs[j] += policy_stats[j][i].secs;
+	}
+	printf("\n");
+	ops += policy_stats[0][i].ops;
+	valid++;
+    }
 
+    /* Aggregate over the traces that every policy completed */
+    if (valid > 0) {
+	printf("%5s", "Total");
+	for (j = 0; j < NPOLICIES; j++)
+	    printf("%7.0f%%%8.0f", (util[j]/valid)*100.0, (ops/1e3)/secs[j]);
+	printf("\n");
+    }
+}
+
+/*
+ * printdeferred - prints the utilization and throughput of each trace
+ *     with immediate and with deferred coalescing, and the speedup of
+ *     the deferred mode
+ */
+static void printdeferred(int n, stats_t *stats, stats_t *deferred_stats)
+{
+    int i, valid = 0;
+    double util[2] = {0, 0}, secs[2] = {0, 0}, ops = 0;
+
+    printf("%5s%8s%8s%10s%10s%9s\n", 
+	   "trace", "util", "d-util", "Kops", "d-Kops", "speedup");
+    for (i = 0; i < n; i++) {
+	if (!stats[i].valid || !deferred_stats[i].valid) {
+	    printf("%2d%11s%8s%10s%10s%9s\n", i, "-", "-", "-", "-", "-");
+	    continue;
+	}
+	printf("%2d%10.0f%%%7.0f%%%10.0f%10.0f%8.2fx\n", 
+	       i,
+	       stats[i].util*100.0,
+	       deferred_stats[i].util*100.0,
+	       (stats[i].ops/1e3)/stats[i].secs,
+	       (deferred_stats[i].ops/1e3)/deferred_stats[i].secs,
+	       stats[i].secs/deferred_stats[i].secs);
+	util[0] += stats[i].util;
+	util[1] += deferred_stats[i].util;
+	secs[0] += stats[i].secs;
+	secs[1] += deferred_stats[i].secs;
+	ops += stats[i].ops;
+	valid++;
+    }
+
+    /* Aggregate over the traces that both modes completed */
+    if (valid > 0)
+	printf("%5s%7.0f%%%7.0f%%%10.0f%10.0f%8.2fx\n", 
+	       "Total",
+	       (util[0]/valid)*100.0,
+	       (util[1]/valid)*100.0,
+	       (ops/1e3)/secs[0],
+	       (ops/1e3)/secs[1],
+	       secs[0]/secs[1]);
+}
+
+/*
+ * printfooters - prints the utilization of each trace with and without
+ *     a footer on allocated blocks, to two decimals since the gain is
+ *     often below the one percent of the other tables
+ */
+static void printfooters(int n, stats_t *stats, stats_t *footer_stats)
+{
+    int i, valid = 0;
+    double util[2] = {0, 0};
+
+    printf("%5s%10s%10s%10s\n", "trace", "f-util", "util", "gain");
+    for (i = 0; i < n; i++) {
+	if (!stats[i].valid || !footer_stats[i].valid) {
+	    printf("%2d%13s%10s%10s\n", i, "-", "-", "-");
+	    continue;
+	}
+	printf("%2d%12.2f%%%9.2f%%%+10.2f\n", 
+	       i,
+	       footer_stats[i].util*100.0,
+	       stats[i].util*100.0,
+	       (stats[i].util - footer_stats[i].util)*100.0);
+	util[0] += footer_stats[i].util;
+	util[1] += stats[i].util;
+	valid++;
+    }
+
+    /* Aggregate over the traces that both layouts completed */
+    if (valid > 0)
+	printf("%5s%9.2f%%%9.2f%%%+10.2f\n", 
+	       "Total",
+	       (util[0]/valid)*100.0,
+	       (util[1]/valid)*100.0,
+	       ((util[1] - util[0])/valid)*100.0);
+}
+
+/*
+ * read_classes - read a class table for mm_set_classes. Each line of
+ *     the file is blank, a # comment, or a key and its values:
+ *         lists <bound> <bound> ...   smallest block size of each list
+ *         chunk <bytes>               least bytes the heap grows by
+ *         initchunk <bytes>           bytes the heap starts with
+ */
+static void read_classes(char *path, mm_classes_t *classes)
+{
+    FILE *fp;
+    char line[MAXLINE], key[MAXLINE];
+    char *word;
+    int seen = 0;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+	sprintf(msg, "Could not open %s in read_classes", path);
+	unix_error(msg);
+    }
+    memset(classes, 0, sizeof(*classes));
+    while (fgets(line, MAXLINE, fp) != NULL) {
+	if (sscanf(line, "%s", key) != 1 || key[0] == '#')
+	    continue;
+	if (!strcmp(key, "lists")) {
+	    strtok(line, " \t\n");
+	    while ((word = strtok(NULL, " \t\n")) != NULL) {
+		if (classes->nlists == MM_MAX_LISTS)
+		    app_error("Too many lists in class table");
+		classes->bounds[classes->nlists++] = (unsigned)strtoul(word, NULL, 0);
+	    }
+	    seen |= 1;
+	}
+	else if (!strcmp(key, "chunk") && sscanf(line, "%*s %zu", &classes->chunk) == 1)
+	    seen |= 2;
+	else if (!strcmp(key, "initchunk") && sscanf(line, "%*s %zu", &classes->init_chunk) == 1)
+	    seen |= 4;
+	else {
+	    printf("Bogus line in class table %s: %s", path, line);
+	    exit(1);
+	}
+    }
+    fclose(fp);
+    if (seen != 7) {
+	sprintf(msg, "Class table %s needs lists, chunk and initchunk", path);
+	app_error(msg);
+    }
 }
 
 /* 
@@ -1004,14 +2676,25 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValLcdpF] [-f <file>] [-t <dir>] [-T <n>] [-Q <n>] [-j <n>] [-P <n>] [-o <file>] [-C <file>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
-    fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-C <file>  Load the free list classes and chunk sizes from <file>.\n");
+    fprintf(stderr, "\t-c         Check the whole heap after every request (mm.c built with -DMM_CHECK).\n");
+    fprintf(stderr, "\t-d         Compare deferred with immediate coalescing.\n");
+    fprintf(stderr, "\t-F         Report the utilization gain of allocated blocks without a footer.\n");
+    fprintf(stderr, "\t-f <file>  Use <file> as the trace file, repeat for several.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-j <n>     Evaluate up to <n> traces at once in worker processes.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-o <file>  Write the heap layout samples of -P to <file>.\n");
+    fprintf(stderr, "\t-p         Compare best fit with first fit and next fit placement.\n");
+    fprintf(stderr, "\t-P <n>     Sample the heap layout every <n> requests.\n");
+    fprintf(stderr, "\t-L         Print latency percentiles of each request type.\n");
+    fprintf(stderr, "\t-Q <n>     Also replay each trace on 1, 2, 4, ... <n> producer/consumer pairs.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <n>     Also replay each trace on 1, 2, 4, ... <n> threads.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
@@ -2,7 +2,15 @@
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
+ *
+ *            Besides the heap, it hands out regions mapped with mmap, so
+ *            that huge blocks need not fit in MAX_HEAP. The regions live
+ *            until they are unmapped or the heap is reset.
+ *
+ *            It never calls malloc, so the shim in mmshim.c can run it
+ *            under an mm.c that stands in for malloc.
  */
+#define _GNU_SOURCE  /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -16,22 +24,53 @@
 
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
-static char *mem_brk;        /* points to last byte of heap */
+static char *mem_brk;        /* points to last byte of heap, see mem_heap_hi */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_fresh_brk;  /* the storage from here on reads as zero, at or above mem_brk */
+static size_t mem_peak_size; /* highest heap size plus mapped bytes since the last reset */
+
+/* a region mapped by mem_map */
+typedef struct mapping {
+    char *addr;
+    size_t len;
+    struct mapping *next;
+} mapping_t;
+
+static mapping_t *mem_mappings; /* regions mapped since the last reset */
+static size_t mem_mapped;       /* their total length */
+static mapping_t *mem_spare;    /* unused records of regions */
+
+static mapping_t **find_mapping(void *addr);
+static mapping_t *new_mapping(void);
+static void free_mapping(mapping_t *m);
+static void update_peak(void);
+static size_t mem_resident(char *addr, size_t len);
+
+/* rounds an address up or down to a page boundary */
+#define PAGE_UP(p)   ((char *)(((unsigned long)(p) + mem_pagesize() - 1) & ~(mem_pagesize() - 1)))
+#define PAGE_DOWN(p) ((char *)((unsigned long)(p) & ~(mem_pagesize() - 1)))
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-    fprintf(stderr, "mem_init_vm: malloc error\n");
+    /* 
+     * map the storage we will use to model the available VM, so that
+     * pages can be given back to the system with madvise. Only the
+     * pages the heap touches take memory.
+     */
+    mem_start_brk = (char *)mmap(NULL, MAX_HEAP, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+    fprintf(stderr, "mem_init_vm: mmap error\n");
     exit(1);
     }
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_fresh_brk = mem_start_brk;            /* and never touched */
+    mem_peak_size = 0;
 }
 
 /* 
@@ -39,35 +78,238 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    mem_reset_brk();
+    munmap(mem_start_brk, MAX_HEAP);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *    and unmap the regions the last heap left mapped. The storage keeps
+ *    what the last heap wrote, until it is released.
  */
 void mem_reset_brk()
 {
-    mem_brk = mem_start_brk;
+    mapping_t *m;
+
+    while ((m = mem_mappings) != NULL) {
+	mem_mappings = m->next;
+	munmap(m->addr, m->len);
+	free_mapping(m);
+    }
+    mem_mapped = 0;
+    __atomic_store_n(&mem_brk, mem_start_brk, __ATOMIC_RELAXED);
+    mem_peak_size = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap and gives the whole pages above
+ *    the new brk back to the system, up to the fresh storage.
  */
 void *mem_sbrk(int incr) 
 {
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if ((mem_brk + incr) < mem_start_brk) {
+        errno = EINVAL;
+        fprintf(stderr, "ERROR: mem_sbrk failed. Shrinks below the heap...\n");
+        return (void *)-1;
+    }
+    if ((mem_brk + incr) > mem_max_addr) {
         errno = ENOMEM;
         fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
         return (void *)-1;
     }
-    mem_brk += incr;
+    __atomic_store_n(&mem_brk, mem_brk + incr, __ATOMIC_RELAXED);
+    update_peak();
+    if (incr < 0)
+	mem_release(mem_brk, PAGE_UP(mem_fresh_brk) - mem_brk);
+    else if (mem_brk > mem_fresh_brk)
+	mem_fresh_brk = mem_brk;
     return (void *)old_brk;
 }
 
+/*
+ * mem_release - give the whole pages inside [addr, addr+len) back to 
+ *    the system. The heap keeps its size, and the pages read as zero 
+ *    the next time they are touched.
+ */
+void mem_release(void *addr, size_t len)
+{
+    char *lo = PAGE_UP(addr);
+    char *hi = PAGE_DOWN((char *)addr + len);
+
+    assert((char *)addr >= mem_start_brk && (char *)addr + len <= mem_max_addr);
+    if (hi > lo)
+	madvise(lo, hi - lo, MADV_DONTNEED);
+
+    /* Released up to the fresh storage, the fresh storage starts lower */
+    if (hi > lo && lo <= mem_fresh_brk && hi >= mem_fresh_brk)
+	mem_fresh_brk = (lo > mem_brk) ? lo : mem_brk;
+}
+
+/*
+ * mem_fresh - return the lowest address at or above the brk from which
+ *    the storage of the heap reads as zero: the heap never reached it
+ *    since the last release, so mem_sbrk hands it out untouched
+ */
+void *mem_fresh(void)
+{
+    return (void *)mem_fresh_brk;
+}
+
+/*
+ * mem_map - map a region of len bytes, rounded up to whole pages,
+ *    outside the heap. Returns NULL if the system has no room for it.
+ */
+void *mem_map(size_t len)
+{
+    mapping_t *m;
+    char *addr;
+
+    len = (size_t)PAGE_UP(len);
+    addr = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+	return NULL;
+    if ((m = new_mapping()) == NULL) {
+	munmap(addr, len);
+	return NULL;
+    }
+    m->addr = addr;
+    m->len = len;
+    m->next = mem_mappings;
+    mem_mappings = m;
+    mem_mapped += len;
+    update_peak();
+    return (void *)addr;
+}
+
+/*
+ * mem_unmap - unmap a region returned by mem_map or mem_remap
+ */
+void mem_unmap(void *addr)
+{
+    mapping_t **link = find_mapping(addr);
+    mapping_t *m = *link;
+
+    assert(m != NULL);
+    *link = m->next;
+    munmap(m->addr, m->len);
+    mem_mapped -= m->len;
+    free_mapping(m);
+}
+
+/*
+ * mem_remap - resize a mapped region to len bytes, rounded up to whole
+ *    pages. The pages move without a copy if the region cannot grow in
+ *    place. Returns the new address, or NULL if the region is unchanged.
+ */
+void *mem_remap(void *addr, size_t len)
+{
+    mapping_t *m = *find_mapping(addr);
+    char *new_addr;
+
+    assert(m != NULL);
+    len = (size_t)PAGE_UP(len);
+    new_addr = (char *)mremap(m->addr, m->len, len, MREMAP_MAYMOVE);
+    if (new_addr == MAP_FAILED)
+	return NULL;
+    mem_mapped = mem_mapped - m->len + len;
+    m->addr = new_addr;
+    m->len = len;
+    update_peak();
+    return (void *)new_addr;
+}
+
+/*
+ * mem_next_map - return the region mapped after the one at addr, or
+ *    the first one for NULL, and NULL after the last. The regions come
+ *    in no particular order.
+ */
+void *mem_next_map(void *addr)
+{
+    mapping_t *m = (addr == NULL) ? mem_mappings : (*find_mapping(addr))->next;
+
+    return (m != NULL) ? (void *)m->addr : NULL;
+}
+
+/*
+ * mem_mapping - return 1 if [lo, hi] lies in one mapped region
+ */
+int mem_mapping(void *lo, void *hi)
+{
+    mapping_t *m;
+
+    for (m = mem_mappings; m != NULL; m = m->next)
+	if ((char *)lo >= m->addr && (char *)hi < m->addr + m->len)
+	    return 1;
+    return 0;
+}
+
+/*
+ * mem_mapsize - returns the bytes in mapped regions
+ */
+size_t mem_mapsize()
+{
+    return mem_mapped;
+}
+
+/*
+ * find_mapping - return the link that points to the region mapped at addr
+ */
+static mapping_t **find_mapping(void *addr)
+{
+    mapping_t **link = &mem_mappings;
+
+    while (*link != NULL && (*link)->addr != (char *)addr)
+	link = &(*link)->next;
+    return link;
+}
+
+/*
+ * new_mapping - return an unused record of a region, carving a page
+ *    mapped for them into records when none are left
+ */
+static mapping_t *new_mapping(void)
+{
+    size_t i, n = mem_pagesize() / sizeof(mapping_t);
+    mapping_t *m;
+
+    if (mem_spare == NULL) {
+	m = (mapping_t *)mmap(NULL, mem_pagesize(), PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED)
+	    return NULL;
+	for (i = 0; i < n; i++)
+	    free_mapping(&m[i]);
+    }
+    m = mem_spare;
+    mem_spare = m->next;
+    return m;
+}
+
+/*
+ * free_mapping - keep the record of an unmapped region for reuse
+ */
+static void free_mapping(mapping_t *m)
+{
+    m->next = mem_spare;
+    mem_spare = m;
+}
+
+/*
+ * update_peak - track the highest heap size plus mapped bytes
+ */
+static void update_peak(void)
+{
+    size_t size = (size_t)(mem_brk - mem_start_brk) + mem_mapped;
+
+    if (size > mem_peak_size)
+	mem_peak_size = size;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -77,11 +319,13 @@ void *mem_heap_lo()
 }
 
 /* 
- * mem_heap_hi - return address of last heap byte
+ * mem_heap_hi - return address of last heap byte. A threaded mm.c
+ *    calls it without its lock to tell heap blocks from mapped ones,
+ *    so mem_brk is read and written atomically.
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    return (void *)(__atomic_load_n(&mem_brk, __ATOMIC_RELAXED) - 1);
 }
 
 /*
@@ -92,6 +336,51 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_peak_heapsize() - returns the highest heap size plus mapped bytes
+ *    since the last mem_reset_brk
+ */
+size_t mem_peak_heapsize() 
+{
+    return mem_peak_size;
+}
+
+/*
+ * mem_heap_resident() - returns the bytes of the heap and the mapped
+ *    regions that are backed by physical memory, which leaves out the
+ *    released pages
+ */
+size_t mem_heap_resident()
+{
+    mapping_t *m;
+    size_t resident = mem_resident(mem_start_brk, PAGE_UP(mem_brk) - mem_start_brk);
+
+    for (m = mem_mappings; m != NULL; m = m->next)
+	resident += mem_resident(m->addr, m->len);
+    return resident;
+}
+
+/*
+ * mem_resident - returns the bytes of the pages in [addr, addr+len)
+ *    that are backed by physical memory
+ */
+static size_t mem_resident(char *addr, size_t len)
+{
+    unsigned char vec[1024];  /* one byte for each page, a batch at a time */
+    size_t npages = len / mem_pagesize();
+    size_t i, n, resident = 0;
+
+    for (; npages > 0; npages -= n, addr += n * mem_pagesize()) {
+	n = (npages < sizeof(vec)) ? npages : sizeof(vec);
+	if (mincore(addr, n * mem_pagesize(), vec) != 0)
+	    break;
+	for (i = 0; i < n; i++)
+	    if (vec[i] & 1)
+		resident += mem_pagesize();
+    }
+    return resident;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -14,6 +14,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -41,6 +42,10 @@ team_t team = {
 // rounds up to the nearest multiple of ALIGNMENT
 #define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
 
+// rounds an address down or up to a page boundary
+#define PAGE_DOWN(p) ((char *)((unsigned long)(p) & ~(unsigned long)(mem_pagesize() - 1)))
+#define PAGE_UP(p)   PAGE_DOWN((char *)(p) + mem_pagesize() - 1)
+
 // Size of size_t
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
 
@@ -48,14 +53,85 @@ team_t team = {
 #define WSIZE   4
 #define DSIZE   8
 
-// initialize the heap with this size
-#define INITCHUNKSIZE (1<<6)    // 64 bytes
+// initialize the heap with this size, the class table may change it
+#define INITCHUNKSIZE (class_table.init_chunk)  // 64 bytes by default
 
 // Extend the heap with this size each time
-#define CHUNKSIZE (1<<12)       // 4 kb
+#define CHUNKSIZE (class_table.chunk)           // 4 kb by default
+
+// Room for free lists, a class table may use fewer of them
+#define LISTSIZE    MM_MAX_LISTS
+
+// Give the pages inside a free block of this size or more back to the system
+#define RELEASE_THRESHOLD (1<<16)   // 64 kb
+
+// Keep up to half of the heap in free blocks backed before releasing any of them,
+// so a heap that is reused soon does not fault its pages in again
+#define RETAIN_LIMIT (mem_heapsize() / 2)
+
+// Shrink the heap when the free block at its end reaches this size, keeping CHUNKSIZE of it
+#define TRIM_THRESHOLD (1<<17)      // 128 kb
+
+// Free blocks of this size and up are kept in a balanced tree instead of
+// the free lists. A power of two, so that no free list holds both kinds.
+#define TREE_THRESHOLD (1<<10)  // 1 kb
+
+// Requests of this size and up get a mapping of their own, outside the heap
+#define MMAP_THRESHOLD (1<<18)  // 256 kb
+
+// Least bytes before the payload of a mapped block, the first word holds the length of the
+// mapping and the word before the payload its offset from the start
+#define MAP_OVERHEAD (2 * DSIZE)
+
+// Words in the second level of the free list bitmap
+#define BITMAP_WORDS ((LISTSIZE + 31) / 32)
+
+// Requests up to this many bytes are served from slab runs, without a block header
+#define SLAB_MAX    64
+
+// Sum of slab classes, one for each multiple of ALIGNMENT up to SLAB_MAX
+#define SLAB_CLASSES (SLAB_MAX / ALIGNMENT)
+
+// Size of a slab run, runs start on a boundary of this size
+#define SLAB_RUN_SHIFT 12
+#define SLAB_RUN_SIZE (1<<SLAB_RUN_SHIFT)   // 4 kb
+
+// Words in the bitmap of freed slots of a run, enough for the smallest class
+#define SLAB_MAP_WORDS (SLAB_RUN_SIZE / ALIGNMENT / 32)
+
+// Runs are only carved from the first SLAB_PAGES run-sized pages of the heap
+#define SLAB_PAGES  (1<<16)                 // 256 mb
+
+// Block sizes up to this are served from the per-thread caches in threaded mode
+#define TCACHE_MAX  256
+
+// Sum of per-thread cache bins, one for each block size from 16 to TCACHE_MAX
+#define TCACHE_BINS ((TCACHE_MAX - 2 * DSIZE) / ALIGNMENT + 1)
 
-// Sum of free lists
-#define LISTSIZE    16
+// Blocks moved between a per-thread cache and the free lists at a time
+#define TCACHE_BATCH 8
+
+// Flush a per-thread cache bin when it holds more blocks than this
+#define TCACHE_LIMIT 32
+
+// Block sizes up to this defer their coalescing in deferred mode
+#define QUICK_MAX   256
+
+// Sum of quick lists, one for each block size from 16 to QUICK_MAX
+#define QUICK_BINS  ((QUICK_MAX - 2 * DSIZE) / ALIGNMENT + 1)
+
+// Merge the quick lists when they hold more blocks than this
+#define QUICK_LIMIT 128
+
+// Heap checking. A build with -DMM_CHECK runs the fast level of mm_check after every
+// operation, on the block the operation touched. Release builds compile all of it out.
+#ifdef MM_CHECK
+#define CHECK_TOUCH(ptr) (check_last = (ptr))
+#define CHECK_FAST()     do { if (mm_check(MM_CHECK_FAST) != 0) abort(); } while (0)
+#else
+#define CHECK_TOUCH(ptr)
+#define CHECK_FAST()
+#endif
 
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
@@ -63,22 +139,82 @@ team_t team = {
 // Pack a size and allocated bit into a word
 #define PACK(size, alloc) ((size) | (alloc))
 
+// Allocated bit of the previous block, kept in the header of every block
+#define PREV_ALLOC  0x2
+
+// Set in the header of a free block whose interior pages were given back to the system
+#define RELEASED    0x4
+
+// The same bit in the header of an allocated block: realloc has grown the block before,
+// so the next growth reserves slack behind it
+#define GROWN       0x4
+
+// Slack reserved behind a block that keeps growing, a quarter of its new size
+#define REALLOC_SLACK(size) ALIGN((size) / 4)
+
+// Adjust a request size to a block size. Allocated blocks have no footer, unless mm_set_footers
+// asked for one, but a block must stay big enough to hold a free block's header, links and footer.
+#define BLOCK_SIZE(size) ((size) + alloc_footer <= DSIZE + WSIZE ? 2 * DSIZE : \
+                          ALIGN((size) + WSIZE + alloc_footer))
+
+// Per-thread cache bin of a block size
+#define TCACHE_BIN(size) (((size) - 2 * DSIZE) / ALIGNMENT)
+
+// Quick list of a block size
+#define QUICK_BIN(size) (((size) - 2 * DSIZE) / ALIGNMENT)
+
+// The payload offset of a mapped block, its mapping and length, and the length a request needs
+#define MAP_OFFSET(ptr)        (*(size_t *)((char *)(ptr) - DSIZE))
+#define MAP_BASE(ptr)          ((char *)(ptr) - MAP_OFFSET(ptr))
+#define MAP_LEN(ptr)           (*(size_t *)MAP_BASE(ptr))
+#define MAP_SIZE(size, offset) ((size_t)PAGE_UP((size) + (offset)))
+// The payload of the mapped block whose mapping starts at base
+#define MAP_PAYLOAD(base)      ((char *)(base) + *(size_t *)((char *)(base) + DSIZE))
+
+// Slab class of a request size
+#define SLAB_CLASS(size) (ALIGN(size) / ALIGNMENT - 1)
+
+// The run an object lives in, the index of the run's page in the heap, and the first slot of a run
+#define SLAB_RUN(ptr)   ((slab_run_t *)((unsigned long)(ptr) & ~(unsigned long)(SLAB_RUN_SIZE - 1)))
+#define SLAB_PAGE(ptr)  (((unsigned long)(ptr) - (unsigned long)slab_page_base) >> SLAB_RUN_SHIFT)
+#define SLAB_SLOTS(run) ((char *)(run) + ALIGN(sizeof(slab_run_t)))
+
 // Read and write a word into address p
 #define GET(p)            (*(unsigned int *)(p))
 #define PUT(p, val)       (*(unsigned int *)(p) = (val))
 
-// Set a pointer
-#define SET_PTR(p, ptr) (*(unsigned int *)(p) = (unsigned int)(ptr))
+// The same for the header of an allocated block. In threaded mode mm_free reads it
+// without heap_lock, while the holder of the lock may rewrite its PA bit.
+#define GET_SHARED(p)      __atomic_load_n((unsigned int *)(p), __ATOMIC_RELAXED)
+#define PUT_SHARED(p, val) __atomic_store_n((unsigned int *)(p), (val), __ATOMIC_RELAXED)
+
+// Free list links are stored as 32-bit offsets from the start of the heap,
+// so a free block needs only two words for them on 64-bit builds as well.
+// Offset 0 is the alignment padding word, never a block, and stands for NULL.
+#define PTR_TO_OFFSET(ptr) ((ptr) ? (unsigned int)((char *)(ptr) - heap_base) : 0)
+#define OFFSET_TO_PTR(off) ((off) ? heap_base + (off) : NULL)
+
+// Set a pointer, ptr is evaluated twice
+#define SET_PTR(p, ptr) PUT(p, PTR_TO_OFFSET(ptr))
 
 // Read the size and allocated fields from address p
 #define GET_SIZE(p)  (GET(p) & ~0x7)
 #define GET_ALLOC(p) (GET(p) & 0x1)
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
+#define GET_RELEASED(p)   (GET(p) & RELEASED)
+#define GET_GROWN(p)      (GET(p) & GROWN)
+
+// Set and clear the previous block's allocated bit in the header at address p,
+// which may be the header of an allocated block, only the holder of heap_lock writes it
+#define SET_PREV_ALLOC(p) PUT_SHARED(p, GET(p) | PREV_ALLOC)
+#define CLR_PREV_ALLOC(p) PUT_SHARED(p, GET(p) & ~PREV_ALLOC)
 
-// Pointer of header and footer
+// Pointer of header and footer, only free blocks have a footer
 #define HDRP(ptr) ((char *)(ptr) - WSIZE)
 #define FTRP(ptr) ((char *)(ptr) + GET_SIZE(HDRP(ptr)) - DSIZE)
 
-// The prev block pointer and the next block pointer.
+// The prev block pointer and the next block pointer. The prev block pointer
+// is read from the footer, so it is only valid if the prev block is free.
 #define PREV_BLK_PTR(ptr) ((char *)(ptr) - GET_SIZE((char *)(ptr) - DSIZE))
 #define NEXT_BLK_PTR(ptr) ((char *)(ptr) + GET_SIZE((char *)(ptr) - WSIZE))
 
@@ -87,8 +223,31 @@ team_t team = {
 #define SUCC_PTR(ptr) ((char *)(ptr) + WSIZE)
 
 // The successor free block pointer and the predecessor free block pointer.
-#define PRED(ptr) (*(char **)(ptr))
-#define SUCC(ptr) (*(char **)(SUCC_PTR(ptr)))
+#define PRED(ptr) OFFSET_TO_PTR(GET(PRED_PTR(ptr)))
+#define SUCC(ptr) OFFSET_TO_PTR(GET(SUCC_PTR(ptr)))
+
+// The children, the height and the largest block size of a free block's subtree in the tree,
+// an empty subtree has height 0 and holds no block
+#define LEFT_PTR(ptr)     ((char *)(ptr))
+#define RIGHT_PTR(ptr)    ((char *)(ptr) + WSIZE)
+#define HEIGHT_PTR(ptr)   ((char *)(ptr) + 2 * WSIZE)
+#define TREE_MAX_PTR(ptr) ((char *)(ptr) + 3 * WSIZE)
+#define LEFT(ptr)     OFFSET_TO_PTR(GET(LEFT_PTR(ptr)))
+#define RIGHT(ptr)    OFFSET_TO_PTR(GET(RIGHT_PTR(ptr)))
+#define HEIGHT(ptr)   ((ptr) ? (int)GET(HEIGHT_PTR(ptr)) : 0)
+#define TREE_MAX(ptr) ((ptr) ? (size_t)GET(TREE_MAX_PTR(ptr)) : 0)
+
+// The placement policy orders the free lists and the tree by address instead of by size
+#define BY_ADDRESS (policy != MM_BEST_FIT)
+
+// Tree order: by size, then by address, so every key is unique. By address alone
+// for the address-ordered policies.
+#define TREE_LESS(a, b) (BY_ADDRESS ? ((char *)(a) < (char *)(b)) : \
+                         ((GET_SIZE(HDRP(a)) < GET_SIZE(HDRP(b))) || \
+                          ((GET_SIZE(HDRP(a)) == GET_SIZE(HDRP(b))) && ((char *)(a) < (char *)(b)))))
+
+// Free list order: ascending size, or ascending address for the address-ordered policies
+#define LIST_LESS(a, b) (BY_ADDRESS ? ((char *)(a) < (char *)(b)) : (GET_SIZE(HDRP(a)) < GET_SIZE(HDRP(b))))
 
 
 /* Data structure 
@@ -96,27 +255,29 @@ team_t team = {
 Allocated block:
 
                             31  30  29  ... 5   4   3   2   1   0
-                            +-------------------------+-------+--+
-    Header:                 |   Size of the block     |       | A|
-        block pointer +-->  +-------------------------+-------+--+
+                            +-------------------------+---+--+--+
+    Header:                 |   Size of the block     | G |PA| A|
+        block pointer +-->  +-------------------------+---+--+--+
                             |                                    |
                             |   Payload                          |
                             |                                    |
                             +------------------------------------+
                             |   Padding(optional)                |
-                            +-------------------------+-------+--+
-    Footer:                 |   Size of the block     |       | A|
-                            +-------------------------+-------+--+
+                            +------------------------------------+
+
+    PA: the previous block is allocated. Allocated blocks have no footer,
+    the next block's PA bit stands in for it when coalescing.
+    G: realloc has grown the block, the rest of it is slack for the next growth.
 
 Free block:
 
                             31  30  29  ... 5   4   3   2   1   0
-                            +-------------------------+-------+--+
-    Header:                 |   size of the block     |       | A|
-        block pointer +-->  +-------------------------+-------+--+
-                            |   pointer to its predecessor       |
+                            +-------------------------+---+--+--+
+    Header:                 |   size of the block     | R |PA| A|
+        block pointer +-->  +-------------------------+---+--+--+
+                            |   offset of its predecessor        |
                             +------------------------------------+
-                            |   pointer to its successor         |
+                            |   offset of its successor          |
                             +------------------------------------+
                             |                                    |
                             |   Payload                          |
@@ -127,6 +288,9 @@ Free block:
     Footer:                 |   size of the block     |       | A|
                             +-------------------------+-------+--+
 
+    R: the whole pages between the links and the footer were given back
+    to the system, they read as zero when touched again.
+
 
 Heap:
                             31  30  29  ... 5   4   3   2   1   0
@@ -161,45 +325,335 @@ Segregated free lists:
                             +---+
                             |   |
                             +---+
+
+Free block of TREE_THRESHOLD bytes or more, a node of an AVL tree:
+
+                            31  30  29  ... 5   4   3   2   1   0
+                            +-------------------------+---+--+--+
+    Header:                 |   size of the block     |   |PA| A|
+        block pointer +-->  +-------------------------+---+--+--+
+                            |   offset of its left child         |
+                            +------------------------------------+
+                            |   offset of its right child        |
+                            +------------------------------------+
+                            |   height of its subtree            |
+                            +------------------------------------+
+                            |   largest block size in its subtree|
+                            +------------------------------------+
+                            |                                    |
+                            |   Payload                          |
+                            |                                    |
+                            +-------------------------+---+--+--+
+    Footer:                 |   size of the block     |   |  | A|
+                            +-------------------------+---+--+--+
+
+Slab run, the payload of one allocated block, aligned to SLAB_RUN_SIZE:
+
+                            +-------------------------+---+--+--+
+    Header:                 |   SLAB_RUN_SIZE + 8     |   |PA| 1|
+          run pointer +-->  +-------------------------+---+--+--+  <-- SLAB_RUN_SIZE boundary
+                            |   slab_run_t: list links, class,   |
+                            |   counters, bitmap of freed slots  |
+                            +------------------------------------+
+                            |   slot 0 | slot 1 | ... | slot n-1 |
+                            +------------------------------------+
+                            |   Padding                          |
+                            +------------------------------------+
+
+Objects in a run have no header. A bit per heap page in slab_pages tells
+mm_free and mm_realloc whether a pointer lies in a run.
+
+Mapped block, a request of MMAP_THRESHOLD bytes or more, in a mapping of its own:
+
+                            +------------------------------------+  <-- page boundary
+                            |   length of the mapping            |
+                            +------------------------------------+
+                            |   offset of the payload            |
+                            +------------------------------------+
+                            |   Padding                          |
+                            +------------------------------------+
+                            |   offset of the payload            |
+        block pointer +-->  +------------------------------------+
+                            |                                    |
+                            |   Payload                          |
+                            |                                    |
+                            +------------------------------------+
+
+Mapped blocks have no header either. They lie outside the heap, which
+tells mm_free and mm_realloc that a pointer is one of them. The payload
+starts MAP_OVERHEAD bytes in, or further for mm_memalign. Its offset is
+kept in the second word as well, so the heap walk finds the payload
+from the start of the mapping.
 */
 
 
 // Segregated free lists
 void* segregated_free_lists[LISTSIZE];
 
+// First byte of the heap, free list offsets are relative to it
+static char *heap_base;
+
+// Two-level bitmap of non-empty free lists. Bit i of list_bitmap[w] is set if
+// free list (w * 32 + i) is non-empty, bit w of list_bitmap_top is set if
+// list_bitmap[w] is non-zero.
+static unsigned int list_bitmap_top;
+static unsigned int list_bitmap[BITMAP_WORDS];
+
+// Root of the tree of large free blocks
+static char *tree_root;
+
+// The free list classes and chunk sizes of mm_init when no table is staged: list i
+// holds blocks of [2^i, 2^(i+1)) bytes, lists 0 to 3 stay empty.
+static const mm_classes_t default_classes = {
+    LISTSIZE,
+    {0, 1<<1, 1<<2, 1<<3, 1<<4, 1<<5, 1<<6, 1<<7,
+     1<<8, 1<<9, 1<<10, 1<<11, 1<<12, 1<<13, 1<<14, 1<<15},
+    1<<6,
+    1<<12
+};
+// The table mm_set_classes staged for the next mm_init
+static mm_classes_t staged_classes;
+static const mm_classes_t *staged = &default_classes;
+// The table of the current heap
+static mm_classes_t class_table;
+// Free list of each block size below TREE_THRESHOLD, in steps of ALIGNMENT
+static unsigned char size_list[TREE_THRESHOLD / ALIGNMENT];
+
+// Bytes in free blocks whose pages were not released
+static size_t free_backed;
+
+// No payload ever reached past this address. The heap reads as zero from here on,
+// except for the links and the footer of the free block that holds it.
+static char *heap_clean;
+
+// The placement policy of the current heap, and the one mm_set_policy staged for the next mm_init
+static int policy;
+static int staged_policy = MM_BEST_FIT;
+// Next fit resumes its search at this address, behind the block it placed last
+static char *rover;
+
+// Bytes an allocated block of the current heap reserves for a footer, and what
+// mm_set_footers staged for the next mm_init
+static size_t alloc_footer;
+static size_t staged_footer;
+
+// Header of a slab run, at the start of the run
+typedef struct slab_run {
+    struct slab_run *prev;      // neighbours in the list of runs with free slots
+    struct slab_run *next;
+    unsigned short cls;         // slab class
+    unsigned short size;        // object size
+    unsigned short nslots;      // sum of slots
+    unsigned short bump;        // slots from here on were never handed out
+    unsigned short used;        // slots handed out and not freed yet
+    unsigned short nfree;       // set bits in free_map
+    unsigned int free_map[SLAB_MAP_WORDS];  // freed slots below bump
+} slab_run_t;
+
+// Runs with free slots of each slab class
+static slab_run_t *slab_partial[SLAB_CLASSES];
+// Bit i is set if heap page i is a slab run, pages are counted from slab_page_base.
+// mm_free reads it without heap_lock, so the words are accessed atomically.
+static unsigned int slab_pages[SLAB_PAGES / 32];
+static char *slab_page_base;
+
+// Per-thread cache of allocated small blocks, linked through their first
+// payload word. Blocks keep their allocated bit while cached, so the
+// shared heap never coalesces them.
+typedef struct {
+    void *head[TCACHE_BINS + SLAB_CLASSES];   // block sizes, then slab classes
+    int count[TCACHE_BINS + SLAB_CLASSES];
+    unsigned int generation;    // heap_generation the cached blocks belong to
+} tcache_t;
+
+// If set, the mm_* functions are safe to call from several threads
+static int threaded;
+// Bumped by mm_init, invalidates the blocks in every per-thread cache
+static unsigned int heap_generation;
+// Protects the free lists and the heap in threaded mode
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+// Blocks freed while another thread held heap_lock, linked through their first payload
+// word. Any thread pushes onto it, and whichever thread takes the lock next frees them all.
+// It only saves the freeing thread the wait for the lock: the blocks go back to the one
+// shared heap, not to the thread that allocated them, which has no queue of its own.
+static void *contended_frees;
+// Flushes the cache of an exiting thread
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static __thread tcache_t tcache;
+
+// If set, mm_free defers coalescing blocks of up to QUICK_MAX bytes
+static int deferred;
+// Freed blocks whose coalescing is deferred, by block size. Like the per-thread
+// caches, they keep their allocated bit and are linked through their first payload word.
+static void *quick_lists[QUICK_BINS];
+static int quick_count;
+
+#ifdef MM_CHECK
+// The block or slab object the last operation returned or freed
+static void *check_last;
+#endif
+
 // Extend the heap
 static void* extend_heap(size_t size);
-// Coalesce adjacent free block if exists
+// Coalesce adjacent free block if exists, and insert the result into the free lists
 static void* coalesce(void *block_ptr);
 // Place a block with this size to the free block ptr
 static void* place(void *block_ptr, size_t size);
+// Place a block with this size to the free block ptr, so that the byte offset bytes into its payload is aligned to align
+static void* place_aligned(void *block_ptr, size_t size, size_t align, size_t offset);
+// Find a free block that can hold an aligned block, or extend the heap, and place it
+static void *malloc_aligned(size_t size, size_t align, size_t offset);
+// Find a free block that can hold an aligned block
+static void *aligned_fit(size_t size, size_t align, size_t offset);
+// Bytes before the aligned payload in a free block, a gap must be able to hold a free block
+static inline size_t aligned_lead(void *block_ptr, size_t align, size_t offset);
+
+static void release_block(void *block_ptr, char *lo, char *hi);
 // Insert the free block to the free list
 static void insert_node(void *block_ptr);
 // Delete the free block from the free list
 static void delete_node(void *block_ptr);
+// Find the corresponding free list for a block size
+static inline int list_index(size_t size);
+// Find the first non-empty free list at or above index
+static inline int find_list(int index);
+// Insert and delete a large free block in the tree, return the new root
+static char *tree_insert(char *root, char *block_ptr);
+static char *tree_delete(char *root, char *block_ptr);
+// Take the leftmost block out of a subtree, return the new subtree
+static char *tree_delete_min(char *root, char **min_ptr);
+// Restore the AVL balance of a subtree after one insert or delete below it
+static char *tree_balance(char *root);
+static char *tree_rotate_left(char *root);
+static char *tree_rotate_right(char *root);
+// Find the smallest free block in the tree with at least this size
+static inline void tree_update(char *root);
+static void *tree_first_fit(char *root, size_t size, char *from);
+// Find the smallest free block in a subtree that can hold an aligned block of this size
+static void *tree_aligned_fit(char *root, size_t size, size_t align, size_t offset);
+// Allocate, free and reallocate blocks in the shared heap
+static void *malloc_block(size_t size);
+static void *find_fit(size_t size);
+static void *first_fit(size_t size, char *from);
+static void free_block(void *block_ptr);
+static void *realloc_block(void *block_ptr, size_t size);
+// Route a request to a slab run or a block by its size
+static void *malloc_any(size_t size);
+static void free_any(void *ptr);
+static void *realloc_any(void *ptr, size_t size);
+static void *memalign_any(size_t align, size_t offset, size_t size);
+static void *calloc_any(size_t size);
+// Clear the bytes of a new block that may not read as zero, and move the clean mark past it
+static void zero_block(char *block_ptr, size_t size);
+static inline void heap_touch(void *block_ptr);
+// Allocate and free objects in slab runs
+static void *slab_malloc(size_t size);
+static void slab_free(void *ptr);
+static slab_run_t *slab_new_run(int cls);
+static char *slab_extend_heap(void);
+static void slab_link(slab_run_t *run);
+static void slab_unlink(slab_run_t *run);
+static inline int is_slab(void *ptr);
+// Map, unmap and remap huge blocks
+static void *map_malloc(size_t size, size_t align, size_t offset);
+static void *map_realloc(void *ptr, size_t size);
+static inline int is_mapped(void *ptr);
+// Serve and take back small blocks through the per-thread cache
+static void *tcache_malloc(size_t size);
+static void tcache_free(void *block_ptr, int bin);
+static inline int tcache_bin(size_t size);
+static inline int tcache_bin_of(void *ptr);
+// Return cached blocks to the free lists
+static void tcache_flush(int bin, int count);
+static void tcache_destroy(void *unused);
+static void tcache_create_key(void);
+// Take heap_lock, or try to, and free the blocks queued by other threads
+static void lock_heap(void);
+static int trylock_heap(void);
+// Release heap_lock, freeing the blocks queued while it was held
+static void unlock_heap(void);
+// Queue a chain of blocks for the holder of heap_lock to free, instead of waiting for it
+static void contended_free(void *first, void *last);
+static void contended_drain(void);
+// Defer coalescing small blocks, and merge them in a batch
+static void quick_free(void *block_ptr);
+static void quick_merge(void);
+static int quick_compare(const void *a, const void *b);
+// Add one block to the heap summary of mm_heap_info
+static void heap_info_visit(void *block_ptr, size_t size, int alloc, void *arg);
+#ifdef MM_CHECK
+// Check a block and its neighbours, a slab run, the whole heap, the free lists
+// and a subtree of the tree, return the number of errors found
+static int check_block(void *block_ptr);
+static int check_run(slab_run_t *run);
+static int check_heap(void);
+static int check_lists(size_t *count);
+static int check_tree(char *root, char *lo, char *hi, size_t *count);
+#endif
 
 // mm_init 
 int mm_init(void)
 {   
     char *heap; 
 
+    // Drop the blocks cached by every thread or queued for freeing, they belong to the old heap
+    heap_generation++;
+    contended_frees = NULL;
+    CHECK_TOUCH(NULL);
+
+    // Apply the staged class table, and map every small block size to its list
+    class_table = *staged;
+    for (int size = 0, i = 0; size < TREE_THRESHOLD; size += ALIGNMENT)
+    {
+        while ((i + 1 < class_table.nlists) && (class_table.bounds[i + 1] <= (unsigned int)size))
+            i++;
+        size_list[size / ALIGNMENT] = i;
+    }
+
     // Initialize the segregated free lists
     for (int i = 0; i < LISTSIZE; i++)
     {
         segregated_free_lists[i] = NULL;
     }
+    list_bitmap_top = 0;
+    for (int i = 0; i < BITMAP_WORDS; i++)
+    {
+        list_bitmap[i] = 0;
+    }
+    tree_root = NULL;
+    free_backed = 0;
+    heap_clean = NULL;
+
+    // Apply the staged placement policy
+    policy = staged_policy;
+    rover = NULL;
+    alloc_footer = staged_footer;
+
+    // Initialize the slab runs
+    for (int i = 0; i < SLAB_CLASSES; i++)
+    {
+        slab_partial[i] = NULL;
+    }
+    memset(slab_pages, 0, sizeof(slab_pages));
+
+    // Initialize the quick lists
+    memset(quick_lists, 0, sizeof(quick_lists));
+    quick_count = 0;
 
     // Initialize the heap
     if ((long)(heap = mem_sbrk(4 * WSIZE)) == -1)
         return -1;
+    heap_base = mem_heap_lo();
+    slab_page_base = (char *)((unsigned long)heap_base & ~(unsigned long)(SLAB_RUN_SIZE - 1));
 
     // Padding for memory alignment
     PUT(heap, 0);
     // Prologue block
-    PUT(heap + (1 * WSIZE), PACK(DSIZE, 1));
+    PUT(heap + (1 * WSIZE), PACK(DSIZE, 1) | PREV_ALLOC);
     PUT(heap + (2 * WSIZE), PACK(DSIZE, 1));
     // Epilogue block
-    PUT(heap + (3 * WSIZE), PACK(0, 1));
+    PUT(heap + (3 * WSIZE), PACK(0, 1) | PREV_ALLOC);
 
     // Extend the heap to INITCHUNKSIZE
     if (extend_heap(INITCHUNKSIZE) == NULL)
@@ -208,120 +662,1177 @@ int mm_init(void)
     return 0;
 }
  
+// mm_set_threaded
+void mm_set_threaded(int enable)
+{
+    // Leaving threaded mode, free the blocks still queued
+    if (threaded && !enable)
+        contended_drain();
+    threaded = enable;
+    if (threaded)
+        pthread_once(&tcache_once, tcache_create_key);
+}
+
+// mm_set_classes
+int mm_set_classes(const mm_classes_t *classes)
+{
+    if (classes == NULL)
+    {
+        staged = &default_classes;
+        return 0;
+    }
+
+    // Every block size needs a list, in ascending order
+    if ((classes->nlists < 1) || (classes->nlists > LISTSIZE) || (classes->bounds[0] != 0))
+        return -1;
+    for (int i = 1; i < classes->nlists; i++)
+    {
+        if (classes->bounds[i] <= classes->bounds[i - 1])
+            return -1;
+    }
+
+    // Chunks hold a free block, and trimming a heap keeps a chunk of a TRIM_THRESHOLD block
+    if ((classes->init_chunk < 2 * DSIZE) || (classes->init_chunk % ALIGNMENT) ||
+        (classes->chunk < 2 * DSIZE) || (classes->chunk % ALIGNMENT) ||
+        (classes->init_chunk >= TRIM_THRESHOLD) || (classes->chunk >= TRIM_THRESHOLD))
+        return -1;
+
+    staged_classes = *classes;
+    staged = &staged_classes;
+    return 0;
+}
+
+// mm_set_policy
+int mm_set_policy(int new_policy)
+{
+    if ((new_policy != MM_BEST_FIT) && (new_policy != MM_FIRST_FIT) && (new_policy != MM_NEXT_FIT))
+        return -1;
+
+    staged_policy = new_policy;
+    return 0;
+}
+
+// mm_set_footers
+void mm_set_footers(int enable)
+{
+    staged_footer = enable ? WSIZE : 0;
+}
+
+// mm_set_deferred
+void mm_set_deferred(int enable)
+{
+    if (threaded)
+        lock_heap();
+
+    // Leaving deferred mode, merge the blocks it still holds
+    if (!enable && quick_count)
+        quick_merge();
+    deferred = enable;
+
+    if (threaded)
+        unlock_heap();
+}
+
 // mm_malloc
 void *mm_malloc(size_t size)
 {
-    if (size == 0)
-        return NULL;
-    
-    // Memory alignment
-    if (size <= DSIZE)
-        size = 2 * DSIZE;
-    else
-        size = ALIGN(size + DSIZE);
+    void *ptr;
+
+    if (size == 0)
+        return NULL;
+
+    if (!threaded)
+        return malloc_any(size);
+
+    // Small blocks come from the per-thread cache, the rest from the shared heap
+    if (BLOCK_SIZE(size) <= TCACHE_MAX)
+        return tcache_malloc(size);
+
+    lock_heap();
+    ptr = malloc_any(size);
+    unlock_heap();
+    return ptr;
+}
+
+// mm_free
+void mm_free(void *block_ptr)
+{
+    int bin;
+
+    if (!threaded)
+    {
+        free_any(block_ptr);
+        return;
+    }
+
+    if ((bin = tcache_bin_of(block_ptr)) >= 0)
+    {
+        tcache_free(block_ptr, bin);
+        return;
+    }
+
+    // Another thread holds the heap, leave the block to it
+    if (trylock_heap() < 0)
+    {
+        contended_free(block_ptr, block_ptr);
+        return;
+    }
+    free_any(block_ptr);
+    unlock_heap();
+}
+
+// mm_realloc
+void *mm_realloc(void *block_ptr, size_t size)
+{
+    void *ptr;
+
+    if (size == 0)
+        return NULL;
+
+    if (!threaded)
+        return realloc_any(block_ptr, size);
+
+    lock_heap();
+    ptr = realloc_any(block_ptr, size);
+    unlock_heap();
+    return ptr;
+}
+
+// mm_usable_size
+size_t mm_usable_size(void *block_ptr)
+{
+    // The caller owns the block, so its size cannot change, only the PA bit of its header
+    if (is_mapped(block_ptr))
+        return MAP_LEN(block_ptr) - MAP_OFFSET(block_ptr);
+    if (is_slab(block_ptr))
+        return SLAB_RUN(block_ptr)->size;
+    return (GET_SHARED(HDRP(block_ptr)) & ~0x7) - WSIZE - alloc_footer;
+}
+
+// mm_fork_prepare
+void mm_fork_prepare(void)
+{
+    if (threaded)
+        lock_heap();
+}
+
+// mm_fork_parent
+void mm_fork_parent(void)
+{
+    if (threaded)
+        unlock_heap();
+}
+
+// mm_fork_child
+void mm_fork_child(void)
+{
+    // Only the forking thread lives on. The blocks the other threads had cached stay
+    // allocated, nothing can reach them any more.
+    if (threaded)
+        pthread_mutex_init(&heap_lock, NULL);
+}
+
+// mm_memalign
+void *mm_memalign(size_t alignment, size_t size)
+{
+    return mm_memalign_offset(alignment, 0, size);
+}
+
+// mm_memalign_offset
+void *mm_memalign_offset(size_t alignment, size_t offset, size_t size)
+{
+    void *ptr;
+
+    if ((size == 0) || (alignment == 0) || (alignment & (alignment - 1)) ||
+        (offset % ALIGNMENT) || (offset >= MAX(alignment, ALIGNMENT)) || (offset >= size))
+        return NULL;
+
+    // Every block is aligned this much already
+    if (alignment <= ALIGNMENT)
+        return mm_malloc(size);
+
+    // Aligned blocks never come from the per-thread caches, they may not be aligned
+    if (!threaded)
+        return memalign_any(alignment, offset, size);
+
+    lock_heap();
+    ptr = memalign_any(alignment, offset, size);
+    unlock_heap();
+    return ptr;
+}
+
+// mm_calloc
+void *mm_calloc(size_t nmemb, size_t size)
+{
+    size_t bytes;
+    void *ptr;
+
+    if (__builtin_mul_overflow(nmemb, size, &bytes) || (bytes == 0))
+        return NULL;
+
+    if (!threaded)
+        return calloc_any(bytes);
+
+    // Blocks in the per-thread cache hold old payloads, clear them all
+    if (BLOCK_SIZE(bytes) <= TCACHE_MAX)
+    {
+        if ((ptr = tcache_malloc(bytes)) != NULL)
+            memset(ptr, 0, bytes);
+        return ptr;
+    }
+
+    lock_heap();
+    ptr = calloc_any(bytes);
+    unlock_heap();
+    return ptr;
+}
+
+// mm_heap_walk
+void mm_heap_walk(mm_visit_t visit, void *arg)
+{
+    char *ptr;
+
+    if (threaded)
+        lock_heap();
+
+    // Taking the lock frees the queued blocks first. Blocks cached by a thread still
+    // have the allocated bit, they are walked as allocated.
+    for (ptr = NEXT_BLK_PTR(heap_base + DSIZE); GET_SIZE(HDRP(ptr)) != 0; ptr = NEXT_BLK_PTR(ptr))
+    {
+        visit(ptr, GET_SIZE(HDRP(ptr)), GET_ALLOC(HDRP(ptr)), arg);
+    }
+
+    // Then the mapped blocks, the whole mapping counts as the block
+    for (ptr = mem_next_map(NULL); ptr != NULL; ptr = mem_next_map(ptr))
+    {
+        visit(MAP_PAYLOAD(ptr), MAP_LEN(MAP_PAYLOAD(ptr)), 1, arg);
+    }
+
+    if (threaded)
+        unlock_heap();
+}
+
+// mm_heap_info
+void mm_heap_info(mm_heap_info_t *info)
+{
+    memset(info, 0, sizeof(*info));
+    // The free lists, then the tree
+    info->nclasses = class_table.nlists + 1;
+    mm_heap_walk(heap_info_visit, info);
+    // After the walk, which may have shrunk the heap freeing queued blocks
+    info->heap_bytes = mem_heapsize() + mem_mapsize();
+}
+
+static void heap_info_visit(void *block_ptr, size_t size, int alloc, void *arg)
+{
+    mm_heap_info_t *info = (mm_heap_info_t *)arg;
+    int class = (size >= TREE_THRESHOLD) ? class_table.nlists : list_index(size);
+
+    if (alloc)
+    {
+        info->alloc_blocks++;
+        info->alloc_bytes += size;
+        return;
+    }
+    info->free_blocks++;
+    info->free_bytes += size;
+    info->largest_free = MAX(info->largest_free, size);
+    info->free_hist[MIN(31 - __builtin_clz((unsigned int)size), MM_SIZE_BINS - 1)]++;
+    info->class_blocks[class]++;
+    info->class_bytes[class] += size;
+}
+
+static void *malloc_any(size_t size)
+{
+    void *ptr;
+
+    // Huge requests get a mapping of their own
+    if (size >= MMAP_THRESHOLD)
+    {
+        ptr = map_malloc(size, ALIGNMENT, 0);
+    }
+    // Tiny requests go to a slab run, unless no run can be carved
+    else if ((size > SLAB_MAX) || ((ptr = slab_malloc(size)) == NULL))
+    {
+        // Memory alignment
+        if ((ptr = malloc_block(BLOCK_SIZE(size))) != NULL)
+            heap_touch(ptr);
+    }
+
+    CHECK_TOUCH(ptr);
+    CHECK_FAST();
+    return ptr;
+}
+
+static void free_any(void *ptr)
+{
+    // There are 4 situations
+    // 1. A mapped block is unmapped right away
+    if (is_mapped(ptr))
+        mem_unmap(MAP_BASE(ptr));
+    // 2. A slab object goes back to its run
+    else if (is_slab(ptr))
+        slab_free(ptr);
+    // 3. A small block waits in a quick list in deferred mode
+    else if (deferred && (GET_SIZE(HDRP(ptr)) <= QUICK_MAX))
+        quick_free(ptr);
+    // 4. Otherwise the block is coalesced now
+    else
+        free_block(ptr);
+
+    CHECK_FAST();
+}
+
+static void *realloc_any(void *ptr, size_t size)
+{
+    slab_run_t *run = SLAB_RUN(ptr);
+    void *new_ptr = ptr;
+
+    // There are 4 situations
+    // 1. A mapped block, remap it
+    if (is_mapped(ptr))
+    {
+        new_ptr = map_realloc(ptr, size);
+    }
+    // 2. A block that outgrows the heap moves into a mapping
+    else if (!is_slab(ptr) && (size >= MMAP_THRESHOLD) && (BLOCK_SIZE(size) > GET_SIZE(HDRP(ptr))))
+    {
+        if ((new_ptr = map_malloc(size, ALIGNMENT, 0)) != NULL)
+        {
+            memcpy(new_ptr, ptr, GET_SIZE(HDRP(ptr)) - WSIZE);
+            free_block(ptr);
+        }
+    }
+    // 3. Any other block, resize it
+    else if (!is_slab(ptr))
+    {
+        if ((new_ptr = realloc_block(ptr, BLOCK_SIZE(size))) != NULL)
+            heap_touch(new_ptr);
+    }
+    // 4. An object that outgrows its slot moves out of the run, otherwise it keeps the slot
+    else if (size > run->size)
+    {
+        if ((new_ptr = malloc_any(size)) != NULL)
+        {
+            memcpy(new_ptr, ptr, run->size);
+            slab_free(ptr);
+        }
+    }
+
+    CHECK_TOUCH(new_ptr);
+    CHECK_FAST();
+    return new_ptr;
+}
+
+static void *memalign_any(size_t align, size_t offset, size_t size)
+{
+    void *ptr;
+
+    // Huge requests, and huge alignments, get a mapping of their own
+    if ((size >= MMAP_THRESHOLD) || (align >= MMAP_THRESHOLD - size))
+    {
+        ptr = map_malloc(size, align, offset);
+    }
+    // Others are carved out of a free block, slab slots are never aligned beyond their size
+    else if ((ptr = malloc_aligned(BLOCK_SIZE(size), align, offset)) != NULL)
+    {
+        heap_touch(ptr);
+    }
+
+    CHECK_TOUCH(ptr);
+    CHECK_FAST();
+    return ptr;
+}
+
+static void *calloc_any(size_t size)
+{
+    char *ptr;
+
+    // There are 3 situations
+    // 1. A huge request gets a new mapping, which reads as zero
+    if (size >= MMAP_THRESHOLD)
+    {
+        ptr = map_malloc(size, ALIGNMENT, 0);
+    }
+    // 2. A slot of a slab run may have been used before, clear it
+    else if ((size <= SLAB_MAX) && ((ptr = slab_malloc(size)) != NULL))
+    {
+        memset(ptr, 0, size);
+    }
+    // 3. A heap block only needs the part that held payloads or metadata cleared
+    else if ((ptr = malloc_block(BLOCK_SIZE(size))) != NULL)
+    {
+        zero_block(ptr, size);
+    }
+
+    CHECK_TOUCH(ptr);
+    CHECK_FAST();
+    return ptr;
+}
+
+static void zero_block(char *block_ptr, size_t size)
+{
+    size_t dirty = (heap_clean > block_ptr) ? (size_t)(heap_clean - block_ptr) : 0;
+
+    // Below the clean mark, and the links of the free block it came from
+    dirty = MIN(size, MAX(dirty, 2 * DSIZE));
+    memset(block_ptr, 0, dirty);
+
+    // The footer of that free block lies in the last bytes, unless it was split
+    if (size > dirty)
+        memset(block_ptr + size - MIN(size - dirty, DSIZE), 0, MIN(size - dirty, DSIZE));
+
+    heap_touch(block_ptr);
+}
+
+static inline void heap_touch(void *block_ptr)
+{
+    char *end = HDRP(NEXT_BLK_PTR(block_ptr));
+
+    if (end > heap_clean)
+        heap_clean = end;
+}
+
+static void *malloc_block(size_t size)
+{
+    void *ptr;
+
+    // A deferred block of this size is reused as it is
+    if (quick_count && (size <= QUICK_MAX) && ((ptr = quick_lists[QUICK_BIN(size)]) != NULL))
+    {
+        quick_lists[QUICK_BIN(size)] = *(void **)ptr;
+        quick_count--;
+        return ptr;
+    }
+
+    ptr = find_fit(size);
+
+    // Nothing fits, the deferred blocks may coalesce into a block that does
+    if ((ptr == NULL) && quick_count)
+    {
+        quick_merge();
+        ptr = find_fit(size);
+    }
+
+    // There are no suitable block in the free lists, extend the heap
+    if (ptr == NULL)
+    {
+        if ((ptr = extend_heap(MAX(size, CHUNKSIZE))) == NULL)
+            return NULL;
+    }
+
+    // Place the block, next fit goes on behind it
+    ptr = place(ptr, size);
+    rover = NEXT_BLK_PTR(ptr);
+
+    return ptr;
+}
+
+static void *find_fit(size_t size)
+{
+    int listnumber;
+    void *ptr = NULL;
+
+    // There are 3 placement policies
+    // 1. Address-ordered first fit
+    if (policy == MM_FIRST_FIT)
+        return first_fit(size, NULL);
+
+    // 2. Next fit, the first fit from the rover on, wrapping around to the start of the heap
+    if (policy == MM_NEXT_FIT)
+    {
+        if ((ptr = first_fit(size, rover)) == NULL)
+            ptr = first_fit(size, NULL);
+        return ptr;
+    }
+
+    // 3. Size-ordered best fit
+    if (size < TREE_THRESHOLD)
+    {
+        listnumber = list_index(size);
+        ptr = segregated_free_lists[listnumber];
+
+        // Find free block in the list of this size, its blocks may still be too small
+        while ((ptr != NULL) && ((GET_SIZE(HDRP(ptr)) < size)))
+        {
+            ptr = SUCC(ptr);
+        }
+
+        // Every block in a bigger list fits, take the head of the first non-empty one
+        if ((ptr == NULL) && ((listnumber = find_list(listnumber + 1)) >= 0))
+        {
+            ptr = segregated_free_lists[listnumber];
+        }
+    }
+
+    // Large requests, and small ones no list can serve, take the best fit in the tree
+    if (ptr == NULL)
+    {
+        ptr = tree_first_fit(tree_root, size, NULL);
+    }
+
+    return ptr;
+}
+
+static void *first_fit(size_t size, char *from)
+{
+    char *first = NULL;
+    char *ptr;
+
+    // The lists from the request's own on, each in address order. Only the request's own
+    // list holds blocks too small, every block in a bigger one fits.
+    if (size < TREE_THRESHOLD)
+    {
+        for (int listnumber = find_list(list_index(size)); listnumber >= 0; listnumber = find_list(listnumber + 1))
+        {
+            for (ptr = segregated_free_lists[listnumber]; ptr != NULL; ptr = SUCC(ptr))
+            {
+                // Nothing further down this list comes before the fit found so far
+                if ((first != NULL) && (ptr > first))
+                {
+                    ptr = NULL;
+                    break;
+                }
+                if ((ptr >= from) && (GET_SIZE(HDRP(ptr)) >= size))
+                    break;
+            }
+            if (ptr != NULL)
+                first = ptr;
+        }
+    }
+
+    // And the tree, the lowest address of them all fits first
+    ptr = tree_first_fit(tree_root, size, from);
+    if ((ptr != NULL) && ((first == NULL) || (ptr < first)))
+        first = ptr;
+
+    return first;
+}
+
+static void *malloc_aligned(size_t size, size_t align, size_t offset)
+{
+    void *ptr = aligned_fit(size, align, offset);
+
+    // Nothing fits, the deferred blocks may coalesce into a block that does
+    if ((ptr == NULL) && quick_count)
+    {
+        quick_merge();
+        ptr = aligned_fit(size, align, offset);
+    }
+
+    // Extend the heap by enough for the block and the gap before its aligned payload
+    if (ptr == NULL)
+    {
+        if ((ptr = extend_heap(MAX(size + align + 2 * DSIZE, CHUNKSIZE))) == NULL)
+            return NULL;
+    }
+
+    // The gap before the payload goes back to the free lists, and no bytes are lost to it
+    return place_aligned(ptr, size, align, offset);
+}
+
+static void *aligned_fit(size_t size, size_t align, size_t offset)
+{
+    char *ptr;
+
+    // The lists from the request's own on. A block of a bigger list may still
+    // be too small once its gap is taken off, so each list is searched.
+    if (size < TREE_THRESHOLD)
+    {
+        for (int listnumber = find_list(list_index(size)); listnumber >= 0; listnumber = find_list(listnumber + 1))
+        {
+            for (ptr = segregated_free_lists[listnumber]; ptr != NULL; ptr = SUCC(ptr))
+            {
+                if (aligned_lead(ptr, align, offset) + size <= GET_SIZE(HDRP(ptr)))
+                    return ptr;
+            }
+        }
+    }
+
+    // Then the tree, in the order of the placement policy
+    return tree_aligned_fit(tree_root, size, align, offset);
+}
+
+static void free_block(void *block_ptr)
+{
+    size_t size = GET_SIZE(HDRP(block_ptr));
+    char *next_ptr = NEXT_BLK_PTR(block_ptr);
+    char *lo = (char *)block_ptr;
+    char *hi = next_ptr;
+    
+    // Reset header and footer for current block 
+    PUT(HDRP(block_ptr), PACK(size, 0) | GET_PREV_ALLOC(HDRP(block_ptr)));
+    PUT(FTRP(block_ptr), PACK(size, 0));
+    CLR_PREV_ALLOC(HDRP(next_ptr));
+
+    // The pages that are still backed: the block itself, the free neighbours
+    // that were never released, and the pages around a released neighbour's metadata
+    if (!GET_PREV_ALLOC(HDRP(block_ptr)))
+        lo = GET_RELEASED(HDRP(PREV_BLK_PTR(block_ptr))) ? PAGE_DOWN(HDRP(block_ptr) - WSIZE) : PREV_BLK_PTR(block_ptr);
+    if (!GET_ALLOC(HDRP(next_ptr)))
+        hi = GET_RELEASED(HDRP(next_ptr)) ? PAGE_UP(next_ptr + 2 * DSIZE) : NEXT_BLK_PTR(next_ptr);
+
+    // Coalesce adjacent free block if exists, and insert the result to free list
+    block_ptr = coalesce(block_ptr);
+    CHECK_TOUCH(block_ptr);
+
+    // Give the memory back if the block is big enough
+    release_block(block_ptr, lo, hi);
+}
+
+static void *realloc_block(void *block_ptr, size_t size)
+{
+    size_t old_size = GET_SIZE(HDRP(block_ptr));
+    size_t reserve_size;
+
+    // 1. If target size is smaller than or equal to current size, split off the tail and free it
+    if (size <= old_size)
+    {
+        // A growing block keeps its slack, unless the request drops below half of the block
+        if (GET_GROWN(HDRP(block_ptr)) && (size > old_size / 2))
+            return block_ptr;
+        if (old_size - size >= DSIZE * 2)
+        {
+            PUT(HDRP(block_ptr), PACK(size, 1) | GET_PREV_ALLOC(HDRP(block_ptr)));
+            PUT(HDRP(NEXT_BLK_PTR(block_ptr)), PACK(old_size - size, 1) | PREV_ALLOC);
+            free_block(NEXT_BLK_PTR(block_ptr));
+        }
+        return block_ptr;
+    }
+
+    // 2. Target size is bigger than current size. A block that grew before is
+    // likely to grow again, so it takes some slack when it has to move.
+    reserve_size = GET_GROWN(HDRP(block_ptr)) ? size + REALLOC_SLACK(size) : size;
+
+    // 2.1. If the next block is the epilogue block, or a free block before it, extend the heap directly
+    char *next_ptr = NEXT_BLK_PTR(block_ptr);
+    size_t next_size = GET_ALLOC(HDRP(next_ptr)) ? 0 : GET_SIZE(HDRP(next_ptr));
+    if ((next_size < size - old_size) && (GET_SIZE(HDRP(next_ptr + next_size)) == 0))
+    {
+        // Extend the heap, the new block merges with the free next block. No slack here,
+        // the block can extend the heap again without a copy.
+        size_t extend_size = MAX((size - old_size - next_size), CHUNKSIZE);
+        if (extend_heap(extend_size) == NULL)
+            return NULL;
+
+        // Reset current block
+        delete_node(NEXT_BLK_PTR(block_ptr));
+        size_t new_size = old_size + next_size + extend_size;
+        PUT(HDRP(block_ptr), PACK(new_size, 1) | GET_PREV_ALLOC(HDRP(block_ptr)) | GROWN);
+        SET_PREV_ALLOC(HDRP(NEXT_BLK_PTR(block_ptr)));
+        return block_ptr;
+    }
+
+    // 2.2. If the next block is a free block, and the size if enough to resize the new block
+    if (!GET_ALLOC(HDRP(NEXT_BLK_PTR(block_ptr))))
+    {
+        size_t new_size = GET_SIZE(HDRP(NEXT_BLK_PTR(block_ptr))) + GET_SIZE(HDRP(block_ptr));
+        if(new_size >= size)
+        {
+            unsigned int released = GET_RELEASED(HDRP(next_ptr));
+            delete_node(NEXT_BLK_PTR(block_ptr));
+
+            // Split the rest of a big next block off like place does, the block after it still sees a free block
+            reserve_size = MIN(reserve_size, new_size);
+            if (new_size - reserve_size >= DSIZE * 2)
+            {
+                PUT(HDRP(block_ptr), PACK(reserve_size, 1) | GET_PREV_ALLOC(HDRP(block_ptr)) | GROWN);
+                PUT(HDRP(NEXT_BLK_PTR(block_ptr)), PACK(new_size - reserve_size, 0) | PREV_ALLOC | released);
+                PUT(FTRP(NEXT_BLK_PTR(block_ptr)), PACK(new_size - reserve_size, 0));
+                insert_node(NEXT_BLK_PTR(block_ptr));
+            }
+            else
+            {
+                PUT(HDRP(block_ptr), PACK(new_size, 1) | GET_PREV_ALLOC(HDRP(block_ptr)) | GROWN);
+                SET_PREV_ALLOC(HDRP(NEXT_BLK_PTR(block_ptr)));
+            }
+            return block_ptr;
+        }
+    }
+    
+    // 2.3. If the previous block is free, and the size of it, current block and a free next block is enough,
+    // merge them and move the payload down
+    if (!GET_PREV_ALLOC(HDRP(block_ptr)))
+    {
+        char *prev_ptr = PREV_BLK_PTR(block_ptr);
+        size_t new_size = GET_SIZE(HDRP(prev_ptr)) + old_size + next_size;
+        if (new_size >= size)
+        {
+            delete_node(prev_ptr);
+            if (next_size)
+                delete_node(next_ptr);
+            // The regions overlap when the previous block is smaller than the payload
+            memmove(prev_ptr, block_ptr, old_size - WSIZE);
+
+            // Split the rest off like place does, its neighbours are both allocated
+            reserve_size = MIN(reserve_size, new_size);
+            if (new_size - reserve_size >= DSIZE * 2)
+            {
+                PUT(HDRP(prev_ptr), PACK(reserve_size, 1) | GET_PREV_ALLOC(HDRP(prev_ptr)) | GROWN);
+                PUT(HDRP(NEXT_BLK_PTR(prev_ptr)), PACK(new_size - reserve_size, 0) | PREV_ALLOC);
+                PUT(FTRP(NEXT_BLK_PTR(prev_ptr)), PACK(new_size - reserve_size, 0));
+                insert_node(NEXT_BLK_PTR(prev_ptr));
+                CLR_PREV_ALLOC(HDRP(NEXT_BLK_PTR(NEXT_BLK_PTR(prev_ptr))));
+            }
+            else
+            {
+                PUT(HDRP(prev_ptr), PACK(new_size, 1) | GET_PREV_ALLOC(HDRP(prev_ptr)) | GROWN);
+                SET_PREV_ALLOC(HDRP(NEXT_BLK_PTR(prev_ptr)));
+            }
+            return prev_ptr;
+        }
+    }
+
+    // 2.4. Allocate a new block with the target size
+    void *new_block = malloc_block(reserve_size);
+    if (new_block == NULL)
+        return NULL;
+    memcpy(new_block, block_ptr, old_size - WSIZE);
+    free_block(block_ptr);
+    PUT(HDRP(new_block), GET(HDRP(new_block)) | GROWN);
+    return new_block;
+}
+
+static void *tcache_malloc(size_t size)
+{
+    int bin = tcache_bin(size);
+    void *ptr;
+
+    if (tcache.generation != heap_generation)
+    {
+        // The heap was reset by mm_init, forget the cached blocks
+        memset(&tcache, 0, sizeof(tcache));
+        tcache.generation = heap_generation;
+        pthread_setspecific(tcache_key, &tcache);
+    }
+
+    // 1. Pop a cached block of this size
+    if ((ptr = tcache.head[bin]) != NULL)
+    {
+        tcache.head[bin] = *(void **)ptr;
+        tcache.count[bin]--;
+        return ptr;
+    }
+
+    // 2. Refill the bin with a batch of blocks from the shared heap
+    lock_heap();
+    for (int i = 0; i < TCACHE_BATCH - 1; i++)
+    {
+        if ((ptr = malloc_any(size)) == NULL)
+            break;
+        *(void **)ptr = tcache.head[bin];
+        tcache.head[bin] = ptr;
+        tcache.count[bin]++;
+    }
+    ptr = malloc_any(size);
+    unlock_heap();
+    return ptr;
+}
+
+static void tcache_free(void *block_ptr, int bin)
+{
+    // A block from the heap before the last mm_init, nothing to cache it for
+    if (tcache.generation != heap_generation)
+    {
+        lock_heap();
+        free_any(block_ptr);
+        unlock_heap();
+        return;
+    }
+
+    *(void **)block_ptr = tcache.head[bin];
+    tcache.head[bin] = block_ptr;
+    tcache.count[bin]++;
+
+    // Too many blocks cached, return a batch to the shared heap
+    if (tcache.count[bin] > TCACHE_LIMIT)
+        tcache_flush(bin, TCACHE_BATCH);
+}
+
+static void tcache_flush(int bin, int count)
+{
+    void *first = tcache.head[bin], *last = NULL, *ptr;
+
+    // Unlink a chain of up to count blocks from the bin
+    for (ptr = first; (count-- > 0) && (ptr != NULL); ptr = *(void **)ptr)
+    {
+        last = ptr;
+        tcache.count[bin]--;
+    }
+    if (last == NULL)
+        return;
+    tcache.head[bin] = ptr;
+    *(void **)last = NULL;
+
+    // Another thread holds the heap, leave the chain to it
+    if (trylock_heap() < 0)
+    {
+        contended_free(first, last);
+        return;
+    }
+    while ((ptr = first) != NULL)
+    {
+        first = *(void **)ptr;
+        free_any(ptr);
+    }
+    unlock_heap();
+}
+
+static void tcache_destroy(void *unused)
+{
+    if (tcache.generation != heap_generation)
+        return;
+
+    for (int bin = 0; bin < TCACHE_BINS + SLAB_CLASSES; bin++)
+    {
+        tcache_flush(bin, tcache.count[bin]);
+    }
+}
+
+static void lock_heap(void)
+{
+    pthread_mutex_lock(&heap_lock);
+    contended_drain();
+}
+
+static int trylock_heap(void)
+{
+    if (pthread_mutex_trylock(&heap_lock) != 0)
+        return -1;
+    contended_drain();
+    return 0;
+}
+
+static void unlock_heap(void)
+{
+    pthread_mutex_unlock(&heap_lock);
+
+    // A block queued while the lock was held would wait for the next thread to lock the heap,
+    // which may never come. Its pusher tries the lock once more, so one of the two frees it.
+    while ((__atomic_load_n(&contended_frees, __ATOMIC_SEQ_CST) != NULL) &&
+           (pthread_mutex_trylock(&heap_lock) == 0))
+    {
+        contended_drain();
+        pthread_mutex_unlock(&heap_lock);
+    }
+}
+
+static void contended_free(void *first, void *last)
+{
+    // The whole chain goes on with one swap. Only contended_drain takes blocks off, and it
+    // takes them all, so the head a push read cannot be popped and pushed back meanwhile.
+    *(void **)last = __atomic_load_n(&contended_frees, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&contended_frees, (void **)last, first, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        ;
+
+    // The holder may have looked at the queue for the last time before the push
+    if (trylock_heap() == 0)
+        unlock_heap();
+}
+
+static void contended_drain(void)
+{
+    void *ptr, *next;
+
+    if (__atomic_load_n(&contended_frees, __ATOMIC_RELAXED) == NULL)
+        return;
+
+    for (ptr = __atomic_exchange_n(&contended_frees, NULL, __ATOMIC_ACQUIRE); ptr != NULL; ptr = next)
+    {
+        next = *(void **)ptr;
+        free_any(ptr);
+    }
+}
+
+static inline int tcache_bin(size_t size)
+{
+    // The slab classes follow the block sizes
+    if (size <= SLAB_MAX)
+        return TCACHE_BINS + SLAB_CLASS(size);
+    return TCACHE_BIN(BLOCK_SIZE(size));
+}
+
+static inline int tcache_bin_of(void *ptr)
+{
+    if (is_mapped(ptr))
+        return -1;
+    if (is_slab(ptr))
+        return TCACHE_BINS + SLAB_RUN(ptr)->cls;
+
+    // Too big to cache, or grown by realloc. The cache would hand a grown block to another
+    // request as it is, so it goes back to the heap, which clears the bit under heap_lock.
+    unsigned int header = GET_SHARED(HDRP(ptr));
+    size_t size = header & ~0x7;
+    return ((size <= TCACHE_MAX) && !(header & GROWN)) ? TCACHE_BIN(size) : -1;
+}
+
+static void quick_free(void *block_ptr)
+{
+    int bin = QUICK_BIN(GET_SIZE(HDRP(block_ptr)));
+
+    // The block may be handed to another request, which has not grown yet
+    PUT(HDRP(block_ptr), GET(HDRP(block_ptr)) & ~GROWN);
+    *(void **)block_ptr = quick_lists[bin];
+    quick_lists[bin] = block_ptr;
+    CHECK_TOUCH(block_ptr);
+
+    // Too many blocks deferred, merge them all
+    if (++quick_count > QUICK_LIMIT)
+        quick_merge();
+}
+
+static void quick_merge(void)
+{
+    char *blocks[QUICK_LIMIT + 1];
+    char *ptr, *next_ptr;
+    int n = 0;
+
+    // Take every deferred block off the quick lists
+    for (int bin = 0; bin < QUICK_BINS; bin++)
+    {
+        for (ptr = quick_lists[bin]; ptr != NULL; ptr = *(char **)ptr)
+        {
+            blocks[n++] = ptr;
+        }
+        quick_lists[bin] = NULL;
+    }
+    quick_count = 0;
+
+    // In address order, deferred blocks that are neighbours in the heap are next to each other
+    qsort(blocks, n, sizeof(char *), quick_compare);
+
+    // Join each run of neighbours into one allocated block, and free that once,
+    // so the free lists see one insert per run instead of one per block
+    for (int i = 0; i < n; )
+    {
+        ptr = blocks[i];
+        next_ptr = NEXT_BLK_PTR(ptr);
+        while ((++i < n) && (blocks[i] == next_ptr))
+        {
+            next_ptr = NEXT_BLK_PTR(next_ptr);
+        }
+        PUT(HDRP(ptr), PACK(next_ptr - ptr, 1) | GET_PREV_ALLOC(HDRP(ptr)));
+        free_block(ptr);
+    }
+}
+
+static int quick_compare(const void *a, const void *b)
+{
+    char *x = *(char * const *)a;
+    char *y = *(char * const *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void *map_malloc(size_t size, size_t align, size_t offset)
+{
+    // The mapping starts on a page boundary, an aligned payload lies at most align bytes in,
+    // or offset bytes more if a byte inside it is to be aligned
+    size_t len = MAP_SIZE(size, MAX(align, MAP_OVERHEAD) + offset);
+    char *base, *ptr;
+
+    if ((base = mem_map(len)) == NULL)
+        return NULL;
+    ptr = (char *)(((unsigned long)base + MAP_OVERHEAD + offset + align - 1) & ~(unsigned long)(align - 1)) - offset;
+    *(size_t *)base = len;
+    *(size_t *)(base + DSIZE) = ptr - base;
+    MAP_OFFSET(ptr) = ptr - base;
+    return ptr;
+}
+
+static void *map_realloc(void *ptr, size_t size)
+{
+    size_t len = MAP_LEN(ptr);
+    size_t offset = MAP_OFFSET(ptr);
+    char *base;
+    void *new_ptr;
+
+    // There are 3 situations
+    // 1. The request drops below the threshold, move it into the heap
+    if (size < MMAP_THRESHOLD)
+    {
+        if ((new_ptr = malloc_any(size)) == NULL)
+            return NULL;
+        memcpy(new_ptr, ptr, size);
+        mem_unmap(MAP_BASE(ptr));
+        return new_ptr;
+    }
+    // 2. The mapping has the right number of pages already
+    if (MAP_SIZE(size, offset) == len)
+        return ptr;
+    // 3. Resize the mapping, the pages move without a copy and the payload keeps its offset
+    if ((base = mem_remap(MAP_BASE(ptr), MAP_SIZE(size, offset))) == NULL)
+        return NULL;
+    *(size_t *)base = MAP_SIZE(size, offset);
+    return base + offset;
+}
+
+static inline int is_mapped(void *ptr)
+{
+    // Mappings never overlap the heap
+    return ((char *)ptr < heap_base) || ((char *)ptr > (char *)mem_heap_hi());
+}
+
+static void *slab_malloc(size_t size)
+{
+    int cls = SLAB_CLASS(size);
+    slab_run_t *run = slab_partial[cls];
+    int slot;
+
+    // Every run of this class is full, carve a new one
+    if ((run == NULL) && ((run = slab_new_run(cls)) == NULL))
+        return NULL;
+
+    // 1. Reuse a freed slot
+    if (run->nfree)
+    {
+        int word = 0;
+        while (run->free_map[word] == 0)
+            word++;
+        slot = (word << 5) + __builtin_ctz(run->free_map[word]);
+        run->free_map[word] &= ~(1u << (slot & 31));
+        run->nfree--;
+    }
+    // 2. Bump the pointer into the slots never handed out
+    else
+    {
+        slot = run->bump++;
+    }
+
+    // The run is full, take it off the list
+    if (++run->used == run->nslots)
+        slab_unlink(run);
+
+    return SLAB_SLOTS(run) + slot * run->size;
+}
+
+static void slab_free(void *ptr)
+{
+    slab_run_t *run = SLAB_RUN(ptr);
+    int slot = ((char *)ptr - SLAB_SLOTS(run)) / run->size;
 
-    size_t searchsize = size;
-    void *ptr = NULL;
+    CHECK_TOUCH(run);
 
-    for (int i = 0; i < LISTSIZE; i++)
-    {
-        // Find free list
-        if (((searchsize <= 1) && (segregated_free_lists[i] != NULL)))
-        {
-            ptr = segregated_free_lists[i];
-            // Find free block
-            while ((ptr != NULL) && ((GET_SIZE(HDRP(ptr)) < size)))
-            {
-                ptr = SUCC(ptr);
-            }
-            if (ptr != NULL)
-                break;
-        }
+    // A full run has a free slot again
+    if (run->used == run->nslots)
+        slab_link(run);
+    run->used--;
 
-        searchsize >>= 1;
+    // There are 3 situations
+    // 1. The run is empty and other runs of its class have free slots, give it back to the heap
+    if ((run->used == 0) && ((run->prev != NULL) || (run->next != NULL)))
+    {
+        slab_unlink(run);
+        __atomic_fetch_and(&slab_pages[SLAB_PAGE(run) >> 5], ~(1u << (SLAB_PAGE(run) & 31)), __ATOMIC_RELAXED);
+        free_block(run);
     }
-
-    // There are no suitable block in the free lists, extend the heap
-    if (ptr == NULL)
+    // 2. The run is empty and the last one of its class, keep it and start bumping again
+    else if (run->used == 0)
     {
-        if ((ptr = extend_heap(MAX(size, CHUNKSIZE))) == NULL)
-            return NULL;
+        run->bump = 0;
+        run->nfree = 0;
+        memset(run->free_map, 0, sizeof(run->free_map));
     }
+    // 3. Mark the slot as freed
+    else
+    {
+        run->free_map[slot >> 5] |= 1u << (slot & 31);
+        run->nfree++;
+    }
+}
 
-    // Place the block
-    ptr = place(ptr, size);
+static slab_run_t *slab_new_run(int cls)
+{
+    char *run_ptr;
+    slab_run_t *run;
 
-    return ptr;
+    // There are 2 situations
+    // 1. A free block can hold an aligned run, such as a run given back before, carve it there
+    if (((run_ptr = tree_aligned_fit(tree_root, SLAB_RUN_SIZE + DSIZE, SLAB_RUN_SIZE, 0)) != NULL) &&
+        (SLAB_PAGE(run_ptr + aligned_lead(run_ptr, SLAB_RUN_SIZE, 0)) < SLAB_PAGES))
+    {
+        run_ptr = place_aligned(run_ptr, SLAB_RUN_SIZE + DSIZE, SLAB_RUN_SIZE, 0);
+    }
+    // 2. Otherwise extend the heap by one
+    else if ((run_ptr = slab_extend_heap()) == NULL)
+    {
+        return NULL;
+    }
+    heap_touch(run_ptr);
+    __atomic_fetch_or(&slab_pages[SLAB_PAGE(run_ptr) >> 5], 1u << (SLAB_PAGE(run_ptr) & 31), __ATOMIC_RELAXED);
+
+    // Initialize the run header
+    run = (slab_run_t *)run_ptr;
+    run->cls = cls;
+    run->size = (cls + 1) * ALIGNMENT;
+    run->nslots = (SLAB_RUN_SIZE - ALIGN(sizeof(slab_run_t))) / run->size;
+    run->bump = 0;
+    run->used = 0;
+    run->nfree = 0;
+    memset(run->free_map, 0, sizeof(run->free_map));
+    slab_link(run);
+
+    return run;
 }
 
-// mm_free
-void mm_free(void *block_ptr)
+static char *slab_extend_heap(void)
 {
-    size_t size = GET_SIZE(HDRP(block_ptr));
-    
-    // Reset header and footer for current block 
-    PUT(HDRP(block_ptr), PACK(size, 0));
-    PUT(FTRP(block_ptr), PACK(size, 0));
+    char *brk = (char *)mem_heap_hi() + 1;
+    char *run_ptr = (char *)(((unsigned long)brk + SLAB_RUN_SIZE - 1) & ~(unsigned long)(SLAB_RUN_SIZE - 1));
 
-    // Insert current block to free list
-    insert_node(block_ptr);
+    // The gap before the run boundary must be able to hold a free block
+    if ((run_ptr != brk) && (run_ptr - brk < 2 * DSIZE))
+        run_ptr += SLAB_RUN_SIZE;
+    if (SLAB_PAGE(run_ptr) >= SLAB_PAGES)
+        return NULL;
 
-    // Coalesce adjacent free block if exists
-    coalesce(block_ptr);
+    // Fill the gap with a free block, so the next block's payload starts on the boundary
+    if ((run_ptr != brk) && (extend_heap(run_ptr - brk) == NULL))
+        return NULL;
+
+    // The run is one allocated block, its header is the old epilogue
+    if (mem_sbrk(SLAB_RUN_SIZE + DSIZE) == (void *)-1)
+        return NULL;
+    PUT(HDRP(run_ptr), PACK(SLAB_RUN_SIZE + DSIZE, 1) | GET_PREV_ALLOC(HDRP(run_ptr)));
+    PUT(HDRP(NEXT_BLK_PTR(run_ptr)), PACK(0, 1) | PREV_ALLOC);
+    return run_ptr;
 }
 
-// mm_realloc
-void *mm_realloc(void *block_ptr, size_t size)
+static void slab_link(slab_run_t *run)
 {
-    if (size == 0)
-        return NULL;
+    run->prev = NULL;
+    run->next = slab_partial[run->cls];
+    if (run->next != NULL)
+        run->next->prev = run;
+    slab_partial[run->cls] = run;
+}
 
-    // Memory alignment
-    if (size <= DSIZE)
-        size = 2 * DSIZE;
+static void slab_unlink(slab_run_t *run)
+{
+    if (run->prev != NULL)
+        run->prev->next = run->next;
     else
-        size = ALIGN(size + DSIZE);
-
-    // 1. If target size is smaller than or equal to current size, return the block pointer directly
-    if (size <= GET_SIZE(HDRP(block_ptr)))
-        return block_ptr;
-
-    // 2. Target size is bigger than current size
+        slab_partial[run->cls] = run->next;
+    if (run->next != NULL)
+        run->next->prev = run->prev;
+    run->prev = NULL;
+    run->next = NULL;
+}
 
-    // 2.1. If the next block is the epilogue block, extend the heap directly
-    if (GET_SIZE(HDRP(NEXT_BLK_PTR(block_ptr))) == 0)
-    {
-        // Extend the heap
-        size_t extend_size = MAX((size - GET_SIZE(HDRP(block_ptr))), CHUNKSIZE);
-        if (extend_heap(extend_size) == NULL)
-            return NULL;
+static inline int is_slab(void *ptr)
+{
+    unsigned long page = SLAB_PAGE(ptr);
 
-        // Reset current block
-        delete_node(NEXT_BLK_PTR(block_ptr));
-        size_t new_size = GET_SIZE(HDRP(block_ptr)) + extend_size;
-        PUT(HDRP(block_ptr), PACK(new_size, 1));
-        PUT(FTRP(block_ptr), PACK(new_size, 1));
-        return block_ptr;
-    }
+    // Pointers outside the pages covered by slab_pages are never in a run
+    if (((char *)ptr < slab_page_base) || (page >= SLAB_PAGES))
+        return 0;
+    return (__atomic_load_n(&slab_pages[page >> 5], __ATOMIC_RELAXED) >> (page & 31)) & 1;
+}
 
-    // 2.2. If the next block is a free block, and the size if enough to resize the new block
-    if (!GET_ALLOC(HDRP(NEXT_BLK_PTR(block_ptr))))
-    {
-        size_t new_size = GET_SIZE(HDRP(NEXT_BLK_PTR(block_ptr))) + GET_SIZE(HDRP(block_ptr));
-        if(new_size >= size)
-        {
-            delete_node(NEXT_BLK_PTR(block_ptr));
-            PUT(HDRP(block_ptr), PACK(new_size, 1));
-            PUT(FTRP(block_ptr), PACK(new_size, 1));
-            return block_ptr;
-        }
-    }
-    
-    // 2.3. Allocate a new block with the target size
-    void *new_block = mm_malloc(size);
-    memcpy(new_block, block_ptr, GET_SIZE(HDRP(block_ptr)));
-    mm_free(block_ptr);
-    return new_block;
+static void tcache_create_key(void)
+{
+    pthread_key_create(&tcache_key, tcache_destroy);
 }
 
 static void *extend_heap(size_t size)
@@ -329,38 +1840,41 @@ static void *extend_heap(size_t size)
     void *ptr;
     // Memory alignment
     size = ALIGN(size);
+    // The heap reads as zero from where memlib has never handed out memory
+    heap_clean = mem_fresh();
     // Extend the heap
     if ((ptr = mem_sbrk(size)) == (void *)-1)
         return NULL;
 
-    // Set the header and the footer
-    PUT(HDRP(ptr), PACK(size, 0));
+    // Set the header and the footer, the old epilogue header knows if the prev block is allocated
+    PUT(HDRP(ptr), PACK(size, 0) | GET_PREV_ALLOC(HDRP(ptr)));
     PUT(FTRP(ptr), PACK(size, 0));
     // Set the epilogue block of the heap
     PUT(HDRP(NEXT_BLK_PTR(ptr)), PACK(0, 1));
-    // Insert this new free block into the free lists
-    insert_node(ptr);
-    // If previous block is free, coalesce them
+    // If previous block is free, coalesce them, and insert the result into the free lists
     return coalesce(ptr);
 }
 
 static void insert_node(void *block_ptr)
 {
     size_t size = GET_SIZE(HDRP(block_ptr));
-    int listnumber = 0;
+    int listnumber = list_index(size);
     void *succ_ptr = NULL;
     void *pred_ptr = NULL;
 
-    // Find the corresponding free list for current block
-    while ((listnumber < LISTSIZE - 1) && (size > 1))
+    if (!GET_RELEASED(HDRP(block_ptr)))
+        free_backed += size;
+
+    // Large blocks go to the tree
+    if (size >= TREE_THRESHOLD)
     {
-        size >>= 1;
-        listnumber++;
+        tree_root = tree_insert(tree_root, block_ptr);
+        return;
     }
 
     // Find the insert position for block, keep free list in ascending order
     succ_ptr = segregated_free_lists[listnumber];
-    while ((succ_ptr != NULL) && (GET_SIZE(HDRP(succ_ptr)) < size))
+    while ((succ_ptr != NULL) && LIST_LESS(succ_ptr, block_ptr))
     {
         pred_ptr = succ_ptr;
         succ_ptr = SUCC(succ_ptr);
@@ -415,20 +1929,25 @@ static void insert_node(void *block_ptr)
             SET_PTR(PRED_PTR(block_ptr), NULL);
             // Set the beginning pointer of the free list
             segregated_free_lists[listnumber] = block_ptr;
+            // Mark the list as non-empty
+            list_bitmap[listnumber >> 5] |= 1u << (listnumber & 31);
+            list_bitmap_top |= 1u << (listnumber >> 5);
         }
     }
 }
 
 static void delete_node(void *block_ptr)
 {
-    int listnumber = 0;
-    size_t size = GET_SIZE(HDRP(block_ptr));
+    int listnumber = list_index(GET_SIZE(HDRP(block_ptr)));
 
-    // Find the corresponding free list for current block
-    while ((listnumber < LISTSIZE - 1) && (size > 1))
+    if (!GET_RELEASED(HDRP(block_ptr)))
+        free_backed -= GET_SIZE(HDRP(block_ptr));
+
+    // Large blocks are in the tree
+    if (GET_SIZE(HDRP(block_ptr)) >= TREE_THRESHOLD)
     {
-        size >>= 1;
-        listnumber++;
+        tree_root = tree_delete(tree_root, block_ptr);
+        return;
     }
 
     // There are 4 situations
@@ -464,57 +1983,260 @@ static void delete_node(void *block_ptr)
         {
             // Set the beginning pointer of the free list
             segregated_free_lists[listnumber] = NULL;
+            // Mark the list as empty
+            list_bitmap[listnumber >> 5] &= ~(1u << (listnumber & 31));
+            if (list_bitmap[listnumber >> 5] == 0)
+                list_bitmap_top &= ~(1u << (listnumber >> 5));
+        }
+    }
+}
+
+
+static inline int list_index(size_t size)
+{
+    // Small blocks look their list up, the last list takes all bigger blocks
+    return (size < TREE_THRESHOLD) ? size_list[size / ALIGNMENT] : class_table.nlists - 1;
+}
+
+static inline int find_list(int index)
+{
+    if (index >= LISTSIZE)
+        return -1;
+
+    // 1. A non-empty list in the same bitmap word
+    int word = index >> 5;
+    unsigned int bits = list_bitmap[word] & (~0u << (index & 31));
+    if (bits)
+        return (word << 5) + __builtin_ctz(bits);
+
+    // 2. The first non-empty list in a following bitmap word
+    unsigned int words = list_bitmap_top & ~((2u << word) - 1);
+    if (!words)
+        return -1;
+    word = __builtin_ctz(words);
+    return (word << 5) + __builtin_ctz(list_bitmap[word]);
+}
+
+static char *tree_insert(char *root, char *block_ptr)
+{
+    char *child;
+
+    // The new block becomes a leaf
+    if (root == NULL)
+    {
+        SET_PTR(LEFT_PTR(block_ptr), NULL);
+        SET_PTR(RIGHT_PTR(block_ptr), NULL);
+        PUT(HEIGHT_PTR(block_ptr), 1);
+        PUT(TREE_MAX_PTR(block_ptr), GET_SIZE(HDRP(block_ptr)));
+        return block_ptr;
+    }
+
+    if (TREE_LESS(block_ptr, root))
+    {
+        child = tree_insert(LEFT(root), block_ptr);
+        SET_PTR(LEFT_PTR(root), child);
+    }
+    else
+    {
+        child = tree_insert(RIGHT(root), block_ptr);
+        SET_PTR(RIGHT_PTR(root), child);
+    }
+
+    return tree_balance(root);
+}
+
+static char *tree_delete(char *root, char *block_ptr)
+{
+    char *left, *right, *min_ptr, *child;
+
+    // Find the block by its key, it is always in the tree
+    if (block_ptr != root)
+    {
+        if (TREE_LESS(block_ptr, root))
+        {
+            child = tree_delete(LEFT(root), block_ptr);
+            SET_PTR(LEFT_PTR(root), child);
+        }
+        else
+        {
+            child = tree_delete(RIGHT(root), block_ptr);
+            SET_PTR(RIGHT_PTR(root), child);
+        }
+        return tree_balance(root);
+    }
+
+    // There are 2 situations
+    left = LEFT(root);
+    right = RIGHT(root);
+    // 1. The block has at most one child, the child takes its place
+    if ((left == NULL) || (right == NULL))
+        return (left != NULL) ? left : right;
+
+    // 2. The block has two children, its successor takes its place
+    right = tree_delete_min(right, &min_ptr);
+    SET_PTR(LEFT_PTR(min_ptr), left);
+    SET_PTR(RIGHT_PTR(min_ptr), right);
+    return tree_balance(min_ptr);
+}
+
+static char *tree_delete_min(char *root, char **min_ptr)
+{
+    if (LEFT(root) == NULL)
+    {
+        *min_ptr = root;
+        return RIGHT(root);
+    }
+
+    char *child = tree_delete_min(LEFT(root), min_ptr);
+    SET_PTR(LEFT_PTR(root), child);
+    return tree_balance(root);
+}
+
+static char *tree_balance(char *root)
+{
+    int left_height = HEIGHT(LEFT(root));
+    int right_height = HEIGHT(RIGHT(root));
+
+    // There are 3 situations
+    // 1. The left subtree is too high, rotate right, first rotating a right-heavy left child left
+    if (left_height > right_height + 1)
+    {
+        char *left = LEFT(root);
+        if (HEIGHT(LEFT(left)) < HEIGHT(RIGHT(left)))
+        {
+            left = tree_rotate_left(left);
+            SET_PTR(LEFT_PTR(root), left);
+        }
+        return tree_rotate_right(root);
+    }
+    // 2. The right subtree is too high, the mirror image
+    if (right_height > left_height + 1)
+    {
+        char *right = RIGHT(root);
+        if (HEIGHT(RIGHT(right)) < HEIGHT(LEFT(right)))
+        {
+            right = tree_rotate_right(right);
+            SET_PTR(RIGHT_PTR(root), right);
         }
+        return tree_rotate_left(root);
     }
+    // 3. Still balanced, only update the height and the largest size
+    tree_update(root);
+    return root;
+}
+
+static char *tree_rotate_left(char *root)
+{
+    char *right = RIGHT(root);
+
+    SET_PTR(RIGHT_PTR(root), LEFT(right));
+    tree_update(root);
+    SET_PTR(LEFT_PTR(right), root);
+    tree_update(right);
+    return right;
+}
+
+static char *tree_rotate_right(char *root)
+{
+    char *left = LEFT(root);
+
+    SET_PTR(LEFT_PTR(root), RIGHT(left));
+    tree_update(root);
+    SET_PTR(RIGHT_PTR(left), root);
+    tree_update(left);
+    return left;
+}
+
+static inline void tree_update(char *root)
+{
+    size_t children_max = MAX(TREE_MAX(LEFT(root)), TREE_MAX(RIGHT(root)));
+
+    PUT(HEIGHT_PTR(root), MAX(HEIGHT(LEFT(root)), HEIGHT(RIGHT(root))) + 1);
+    PUT(TREE_MAX_PTR(root), MAX(GET_SIZE(HDRP(root)), children_max));
+}
+
+static void *tree_first_fit(char *root, size_t size, char *from)
+{
+    void *ptr;
+
+    // No block of this subtree fits
+    if ((root == NULL) || (TREE_MAX(root) < size))
+        return NULL;
+
+    // The leftmost block that fits, so the best fit in size order and the first fit in
+    // address order. Blocks below from are all on the left in address order.
+    if ((char *)root < from)
+        return tree_first_fit(RIGHT(root), size, from);
+    if ((ptr = tree_first_fit(LEFT(root), size, from)) != NULL)
+        return ptr;
+    if (GET_SIZE(HDRP(root)) >= size)
+        return root;
+    return tree_first_fit(RIGHT(root), size, from);
 }
 
+static void *tree_aligned_fit(char *root, size_t size, size_t align, size_t offset)
+{
+    void *ptr;
+
+    // No block of this subtree fits, aligned or not
+    if ((root == NULL) || (TREE_MAX(root) < size))
+        return NULL;
+
+    // The blocks before this one in tree order go first
+    if ((ptr = tree_aligned_fit(LEFT(root), size, align, offset)) != NULL)
+        return ptr;
+    if (aligned_lead(root, align, offset) + size <= GET_SIZE(HDRP(root)))
+        return root;
+    return tree_aligned_fit(RIGHT(root), size, align, offset);
+}
 
 static void *coalesce(void *block_ptr)
 {
-    _Bool prev_allocated_flag = GET_ALLOC(HDRP(PREV_BLK_PTR(block_ptr)));
+    _Bool prev_allocated_flag = GET_PREV_ALLOC(HDRP(block_ptr));
     _Bool next_allocated_flag = GET_ALLOC(HDRP(NEXT_BLK_PTR(block_ptr)));
     size_t size = GET_SIZE(HDRP(block_ptr));
 
+    // The links of a free next block end up inside the merged block, behind the clean mark
+    if (!next_allocated_flag)
+        heap_clean = MAX(heap_clean, (char *)NEXT_BLK_PTR(block_ptr) + 2 * DSIZE);
+
     // There are 4 situations
     // 1. The previous block and the next block are both allocated
     if (prev_allocated_flag && next_allocated_flag)
     {
-        return block_ptr;
+        // Nothing to merge
     }
     // 2. The preious block is allocated, but the next block is free
     else if (prev_allocated_flag && !next_allocated_flag)
     {
-        // Delete current block and the next block
-        delete_node(block_ptr);
+        // Delete the next block
         delete_node(NEXT_BLK_PTR(block_ptr));
         // Reset header and footer for the new block
         size += GET_SIZE(HDRP(NEXT_BLK_PTR(block_ptr)));
-        PUT(HDRP(block_ptr), PACK(size, 0));
+        PUT(HDRP(block_ptr), PACK(size, 0) | PREV_ALLOC);
         PUT(FTRP(block_ptr), PACK(size, 0));
     }
     // 3. The previous block is free, but the next block is allocated
     else if (!prev_allocated_flag && next_allocated_flag)
     {
-        // Delete the previous block and current block
+        // Delete the previous block
         delete_node(PREV_BLK_PTR(block_ptr));
-        delete_node(block_ptr);
         // Reset header and footer for the new block
         size += GET_SIZE(HDRP(PREV_BLK_PTR(block_ptr)));
         PUT(FTRP(block_ptr), PACK(size, 0));
-        PUT(HDRP(PREV_BLK_PTR(block_ptr)), PACK(size, 0));
+        PUT(HDRP(PREV_BLK_PTR(block_ptr)), PACK(size, 0) | PREV_ALLOC);
         // Reset current block's pointer
         block_ptr = PREV_BLK_PTR(block_ptr);
     }
     // 4. The previous block and the next block are both free
     else
     {
-        // Delete all three blocks
+        // Delete the previous block and the next block
         delete_node(PREV_BLK_PTR(block_ptr));
-        delete_node(block_ptr);
         delete_node(NEXT_BLK_PTR(block_ptr));
         // Reset header and footer for the new block
         size += GET_SIZE(HDRP(PREV_BLK_PTR(block_ptr))) + GET_SIZE(HDRP(NEXT_BLK_PTR(block_ptr)));
-        PUT(HDRP(PREV_BLK_PTR(block_ptr)), PACK(size, 0));
+        PUT(HDRP(PREV_BLK_PTR(block_ptr)), PACK(size, 0) | PREV_ALLOC);
         PUT(FTRP(NEXT_BLK_PTR(block_ptr)), PACK(size, 0));
         // Reset current block's pointer
         block_ptr = PREV_BLK_PTR(block_ptr);
@@ -526,27 +2248,338 @@ static void *coalesce(void *block_ptr)
     return block_ptr;
 }
 
+static void release_block(void *block_ptr, char *lo, char *hi)
+{
+    size_t size = GET_SIZE(HDRP(block_ptr));
+    char *next_ptr = NEXT_BLK_PTR(block_ptr);
+
+    // There are 3 situations
+    // 1. The block ends the heap and is big enough, shrink the heap and keep CHUNKSIZE of it
+    if ((GET_SIZE(HDRP(next_ptr)) == 0) && (size >= TRIM_THRESHOLD) && (free_backed > RETAIN_LIMIT))
+    {
+        delete_node(block_ptr);
+        if (mem_sbrk(-(int)(size - CHUNKSIZE)) == (void *)-1)
+        {
+            insert_node(block_ptr);
+            return;
+        }
+        PUT(HDRP(block_ptr), PACK(CHUNKSIZE, 0) | GET_PREV_ALLOC(HDRP(block_ptr)));
+        PUT(FTRP(block_ptr), PACK(CHUNKSIZE, 0));
+        PUT(HDRP(NEXT_BLK_PTR(block_ptr)), PACK(0, 1));
+        insert_node(block_ptr);
+    }
+    // 2. The block is big enough, release the backed pages between its links and its footer
+    else if ((size >= RELEASE_THRESHOLD) && (free_backed > RETAIN_LIMIT))
+    {
+        lo = MAX(lo, (char *)block_ptr + 2 * DSIZE);
+        hi = MIN(hi, FTRP(block_ptr));
+        if (hi > lo)
+            mem_release(lo, hi - lo);
+        PUT(HDRP(block_ptr), GET(HDRP(block_ptr)) | RELEASED);
+        free_backed -= size;
+    }
+    // 3. The block is small, keep it
+}
+
 static void* place(void *block_ptr, size_t size)
 {
     size_t free_size = GET_SIZE(HDRP(block_ptr));
     size_t remaining_size = free_size - size;
+    unsigned int released = GET_RELEASED(HDRP(block_ptr));
 
     delete_node(block_ptr);
 
     // The remaining free block is too small, don't split
     if (remaining_size < DSIZE * 2)
     {
-        PUT(HDRP(block_ptr), PACK(free_size, 1));
-        PUT(FTRP(block_ptr), PACK(free_size, 1));
+        PUT(HDRP(block_ptr), PACK(free_size, 1) | GET_PREV_ALLOC(HDRP(block_ptr)));
+        SET_PREV_ALLOC(HDRP(NEXT_BLK_PTR(block_ptr)));
     }
     // Split
     else
     {
-        PUT(HDRP(block_ptr), PACK(size, 1));
-        PUT(FTRP(block_ptr), PACK(size, 1));
-        PUT(HDRP(NEXT_BLK_PTR(block_ptr)), PACK(remaining_size, 0));
+        PUT(HDRP(block_ptr), PACK(size, 1) | GET_PREV_ALLOC(HDRP(block_ptr)));
+        // The remainder's interior pages are a part of the old block's, so they stay released
+        PUT(HDRP(NEXT_BLK_PTR(block_ptr)), PACK(remaining_size, 0) | PREV_ALLOC | released);
         PUT(FTRP(NEXT_BLK_PTR(block_ptr)), PACK(remaining_size, 0));
         insert_node(NEXT_BLK_PTR(block_ptr));
     }
     return block_ptr;
-}
\ No newline at end of file
+}
+
+static inline size_t aligned_lead(void *block_ptr, size_t align, size_t offset)
+{
+    char *ptr = (char *)(((unsigned long)block_ptr + offset + align - 1) & ~(unsigned long)(align - 1)) - offset;
+
+    if ((ptr != (char *)block_ptr) && (ptr - (char *)block_ptr < 2 * DSIZE))
+        ptr += align;
+    return ptr - (char *)block_ptr;
+}
+
+static void* place_aligned(void *block_ptr, size_t size, size_t align, size_t offset)
+{
+    size_t free_size = GET_SIZE(HDRP(block_ptr));
+    size_t lead = aligned_lead(block_ptr, align, offset);
+    unsigned int released = GET_RELEASED(HDRP(block_ptr));
+    unsigned int prev_alloc = GET_PREV_ALLOC(HDRP(block_ptr));
+    char *ptr = (char *)block_ptr + lead;
+
+    delete_node(block_ptr);
+
+    // A tail too small to be a free block stays in the allocated block
+    if (free_size - lead - size < DSIZE * 2)
+        size = free_size - lead;
+
+    // The gap before the aligned payload becomes a free block of its own
+    if (lead)
+    {
+        PUT(HDRP(block_ptr), PACK(lead, 0) | prev_alloc | released);
+        PUT(FTRP(block_ptr), PACK(lead, 0));
+        insert_node(block_ptr);
+        prev_alloc = 0;
+    }
+    PUT(HDRP(ptr), PACK(size, 1) | prev_alloc);
+
+    // And so does the tail behind it, its interior pages stay released as in place
+    if (free_size - lead - size)
+    {
+        PUT(HDRP(NEXT_BLK_PTR(ptr)), PACK(free_size - lead - size, 0) | PREV_ALLOC | released);
+        PUT(FTRP(NEXT_BLK_PTR(ptr)), PACK(free_size - lead - size, 0));
+        insert_node(NEXT_BLK_PTR(ptr));
+    }
+    else
+    {
+        SET_PREV_ALLOC(HDRP(NEXT_BLK_PTR(ptr)));
+    }
+    return ptr;
+}
+
+// mm_check
+int mm_check(int level)
+{
+#ifdef MM_CHECK
+    int errors = 0;
+
+    // The fast level checks the block the last operation touched, the paranoid level the whole heap
+    if ((check_last != NULL) && !is_mapped(check_last))
+        errors += check_block(is_slab(check_last) ? (void *)SLAB_RUN(check_last) : check_last);
+    if (level >= MM_CHECK_PARANOID)
+    {
+        // Free the queued blocks first, they are not allocated any more
+        if (threaded)
+            lock_heap();
+        errors += check_heap();
+        if (threaded)
+            unlock_heap();
+    }
+    return errors ? -1 : 0;
+#else
+    (void)level;
+    return 0;
+#endif
+}
+
+#ifdef MM_CHECK
+// Report an error about a block if cond does not hold, counting it in errors
+#define CHECK(cond, ptr, msg) \
+    do { if (!(cond)) { fprintf(stderr, "mm_check: %s, block %p\n", (msg), (void *)(ptr)); errors++; } } while (0)
+
+static int check_block(void *block_ptr)
+{
+    char *ptr = (char *)block_ptr;
+    char *heap_end = (char *)mem_heap_hi() + 1;
+    size_t size = GET_SIZE(HDRP(ptr));
+    int errors = 0;
+
+    // The header lies in the heap, and the block ends before the epilogue
+    CHECK(ptr > heap_base + DSIZE && ptr < heap_end, ptr, "block outside the heap");
+    if (errors)
+        return errors;
+    CHECK(((unsigned long)ptr % ALIGNMENT) == 0, ptr, "payload not aligned");
+    CHECK(size >= 2 * DSIZE && (size % ALIGNMENT) == 0, ptr, "bad block size");
+    CHECK(ptr + size <= heap_end, ptr, "block runs past the epilogue");
+    if (errors)
+        return errors;
+
+    // The next block knows whether this one is allocated
+    CHECK(!GET_PREV_ALLOC(HDRP(NEXT_BLK_PTR(ptr))) == !GET_ALLOC(HDRP(ptr)), ptr,
+          "next block's previous allocated bit disagrees");
+
+    // There are 2 situations
+    // 1. A free block has a matching footer, and was coalesced with both neighbours
+    if (!GET_ALLOC(HDRP(ptr)))
+    {
+        CHECK(GET(FTRP(ptr)) == PACK(size, 0), ptr, "header and footer disagree");
+        CHECK(GET_PREV_ALLOC(HDRP(ptr)), ptr, "free block after a free block");
+        CHECK(GET_ALLOC(HDRP(NEXT_BLK_PTR(ptr))), ptr, "free block before a free block");
+    }
+    // 2. An allocated block has no footer, a free previous block must end where it starts
+    else
+    {
+        if (!GET_PREV_ALLOC(HDRP(ptr)))
+            CHECK(NEXT_BLK_PTR(PREV_BLK_PTR(ptr)) == ptr && !GET_ALLOC(HDRP(PREV_BLK_PTR(ptr))), ptr,
+                  "previous free block does not end at this block");
+        if (is_slab(ptr))
+            errors += check_run((slab_run_t *)ptr);
+    }
+    return errors;
+}
+
+static int check_run(slab_run_t *run)
+{
+    int errors = 0;
+    int nfree = 0;
+
+    CHECK(((unsigned long)run % SLAB_RUN_SIZE) == 0, run, "slab run not aligned");
+    CHECK(GET_SIZE(HDRP(run)) >= SLAB_RUN_SIZE + DSIZE, run, "slab run block too small");
+    CHECK(run->cls < SLAB_CLASSES && run->size == (run->cls + 1) * ALIGNMENT, run, "bad slab class");
+    if (errors)
+        return errors;
+    CHECK(run->nslots == (SLAB_RUN_SIZE - ALIGN(sizeof(slab_run_t))) / run->size, run, "bad slot count");
+    CHECK(run->bump <= run->nslots && run->used <= run->bump, run, "bad slab counters");
+
+    // Freed slots lie below bump, and every slot below bump is either handed out or freed
+    for (int word = 0; word < SLAB_MAP_WORDS; word++)
+    {
+        nfree += __builtin_popcount(run->free_map[word]);
+        for (int bit = 0; bit < 32; bit++)
+            if ((run->free_map[word] >> bit) & 1)
+                CHECK((word << 5) + bit < run->bump, run, "freed slot above bump");
+    }
+    CHECK(nfree == run->nfree && run->used + run->nfree == run->bump, run, "slab counters disagree with the bitmap");
+    return errors;
+}
+
+static int check_heap(void)
+{
+    char *heap_end = (char *)mem_heap_hi() + 1;
+    char *ptr;
+    size_t free_blocks = 0, listed = 0, backed = 0, runs = 0, marked = 0;
+    int quick = 0;
+    int errors = 0;
+
+    // Prologue and epilogue
+    CHECK(GET(heap_base + WSIZE) == (PACK(DSIZE, 1) | PREV_ALLOC), heap_base + DSIZE, "bad prologue header");
+    CHECK(GET_SIZE(heap_end - WSIZE) == 0 && GET_ALLOC(heap_end - WSIZE), heap_end, "bad epilogue header");
+
+    // Every block in address order, the walk must end exactly at the epilogue
+    for (ptr = NEXT_BLK_PTR(heap_base + DSIZE); ptr < heap_end && GET_SIZE(HDRP(ptr)) != 0; ptr = NEXT_BLK_PTR(ptr))
+    {
+        if (check_block(ptr) != 0)
+            return errors + 1;
+        if (!GET_ALLOC(HDRP(ptr)))
+        {
+            free_blocks++;
+            if (!GET_RELEASED(HDRP(ptr)))
+                backed += GET_SIZE(HDRP(ptr));
+        }
+        else if (is_slab(ptr))
+        {
+            runs++;
+        }
+
+        // Past the clean mark lies a free block, zero but for its links and its footer
+        if (HDRP(NEXT_BLK_PTR(ptr)) > heap_clean)
+        {
+            CHECK(!GET_ALLOC(HDRP(ptr)), ptr, "allocated block past the clean mark");
+            for (char *p = MAX(heap_clean, ptr + 2 * DSIZE); !errors && p < FTRP(ptr); p++)
+                CHECK(*p == 0, p, "byte past the clean mark is not zero");
+            if (errors)
+                return errors;
+        }
+    }
+    CHECK(ptr == heap_end, ptr, "block list does not end at the epilogue");
+
+    // Every page marked as a slab run is the payload of one of the runs walked
+    for (int word = 0; word < SLAB_PAGES / 32; word++)
+        marked += __builtin_popcount(slab_pages[word]);
+    CHECK(marked == runs, slab_page_base, "slab page bitmap disagrees with the runs in the heap");
+
+    // Runs with free slots, and only those, are on the lists of their class
+    for (int cls = 0; cls < SLAB_CLASSES; cls++)
+    {
+        slab_run_t *prev = NULL;
+        for (slab_run_t *run = slab_partial[cls]; run != NULL; prev = run, run = run->next)
+        {
+            CHECK(is_slab(run) && run->cls == cls, run, "slab run on the list of another class");
+            CHECK(run->prev == prev, run, "slab run list links disagree");
+            CHECK(run->used < run->nslots, run, "full slab run on the list");
+            if (errors)
+                return errors;
+        }
+    }
+
+    // Deferred blocks are allocated blocks in the heap, on the quick list of their size
+    for (int bin = 0; bin < QUICK_BINS; bin++)
+    {
+        for (ptr = quick_lists[bin]; ptr != NULL; ptr = *(char **)ptr)
+        {
+            CHECK(ptr > heap_base + DSIZE && ptr < heap_end, ptr, "deferred block outside the heap");
+            if (errors || ++quick > QUICK_LIMIT)
+                return errors + 1;
+            CHECK(GET_ALLOC(HDRP(ptr)) && !is_slab(ptr), ptr, "deferred block not allocated");
+            CHECK(QUICK_BIN(GET_SIZE(HDRP(ptr))) == bin, ptr, "deferred block on the quick list of another size");
+        }
+    }
+    CHECK(quick == quick_count, heap_base, "quick_count disagrees with the quick lists");
+
+    // The free lists and the tree hold exactly the free blocks of the heap
+    errors += check_lists(&listed);
+    errors += check_tree(tree_root, NULL, NULL, &listed);
+    CHECK(listed == free_blocks, heap_base, "free lists disagree with the free blocks in the heap");
+    CHECK(backed == free_backed, heap_base, "free_backed disagrees with the free blocks in the heap");
+    return errors;
+}
+
+static int check_lists(size_t *count)
+{
+    size_t limit = mem_heapsize() / (2 * DSIZE);
+    int errors = 0;
+
+    for (int i = 0; i < LISTSIZE; i++)
+    {
+        char *pred = NULL;
+        int empty = (segregated_free_lists[i] == NULL);
+
+        // The bitmaps mark the non-empty lists
+        CHECK(empty == !((list_bitmap[i >> 5] >> (i & 31)) & 1), segregated_free_lists[i], "list bitmap disagrees");
+        CHECK(empty || ((list_bitmap_top >> (i >> 5)) & 1), segregated_free_lists[i], "top list bitmap disagrees");
+
+        // Free blocks of this class, linked both ways, in the policy's order
+        for (char *ptr = segregated_free_lists[i]; ptr != NULL; pred = ptr, ptr = SUCC(ptr))
+        {
+            CHECK(!GET_ALLOC(HDRP(ptr)), ptr, "allocated block on a free list");
+            CHECK(GET_SIZE(HDRP(ptr)) < TREE_THRESHOLD && list_index(GET_SIZE(HDRP(ptr))) == i, ptr,
+                  "block on the free list of another class");
+            CHECK(PRED(ptr) == pred, ptr, "free list links disagree");
+            CHECK(pred == NULL || !LIST_LESS(ptr, pred), ptr, "free list out of order");
+            // A cycle would never end
+            if (errors || ++*count > limit)
+                return errors + 1;
+        }
+    }
+    return errors;
+}
+
+static int check_tree(char *root, char *lo, char *hi, size_t *count)
+{
+    int errors = 0;
+
+    if (root == NULL)
+        return 0;
+
+    // A free block of the tree's sizes, ordered between its ancestors, in an AVL balanced subtree
+    CHECK(!GET_ALLOC(HDRP(root)) && GET_SIZE(HDRP(root)) >= TREE_THRESHOLD, root, "bad block in the tree");
+    CHECK((lo == NULL || TREE_LESS(lo, root)) && (hi == NULL || TREE_LESS(root, hi)), root, "tree out of order");
+    CHECK(HEIGHT(root) == MAX(HEIGHT(LEFT(root)), HEIGHT(RIGHT(root))) + 1, root, "bad tree height");
+    CHECK(TREE_MAX(root) == MAX(GET_SIZE(HDRP(root)), MAX(TREE_MAX(LEFT(root)), TREE_MAX(RIGHT(root)))), root,
+          "bad largest size in the tree");
+    CHECK(abs(HEIGHT(LEFT(root)) - HEIGHT(RIGHT(root))) <= 1, root, "tree out of balance");
+    if (errors || ++*count > mem_heapsize() / (2 * DSIZE))
+        return errors + 1;
+
+    errors += check_tree(LEFT(root), lo, root, count);
+    errors += check_tree(RIGHT(root), root, hi, count);
+    return errors;
+}
+#endif
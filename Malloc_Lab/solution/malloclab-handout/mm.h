@@ -4,6 +4,135 @@ extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void mm_set_threaded(int enable);
+
+/*
+ * Aligned allocation: mm_memalign returns a block of size bytes whose
+ * payload is aligned to alignment, a power of two, or NULL for any
+ * other alignment. The gap before the aligned payload is split off as
+ * a free block of its own. mm_free and mm_realloc take the block like
+ * any other, though a realloc that moves it only keeps 8 byte alignment.
+ */
+extern void *mm_memalign(size_t alignment, size_t size);
+
+/*
+ * mm_memalign_offset is mm_memalign for a block whose byte at offset
+ * into the payload is to be aligned instead of its first byte, for a
+ * caller that keeps a header of its own in front of an aligned object.
+ * The offset is a multiple of 8 below the alignment and the size.
+ */
+extern void *mm_memalign_offset(size_t alignment, size_t offset, size_t size);
+
+/*
+ * mm_usable_size returns the payload bytes of a block, which may be more
+ * than were asked for. The block must be allocated.
+ */
+extern size_t mm_usable_size(void *ptr);
+
+/*
+ * Fork: mm_fork_prepare takes the heap lock before a fork, so the child
+ * does not get a heap halfway through a request of another thread.
+ * mm_fork_parent releases the lock in the parent, and mm_fork_child
+ * makes it usable again in the child, where only the forking thread
+ * lives on. The blocks the other threads had cached stay allocated.
+ */
+extern void mm_fork_prepare(void);
+extern void mm_fork_parent(void);
+extern void mm_fork_child(void);
+
+/*
+ * Zeroed allocation: mm_calloc returns a block of nmemb * size bytes
+ * that all read as zero, or NULL if the product overflows or is zero.
+ * Memory fresh from mem_sbrk or a new mapping is zero already, so only
+ * the bytes that held an earlier payload or heap metadata are cleared.
+ */
+extern void *mm_calloc(size_t nmemb, size_t size);
+
+/*
+ * Deferred coalescing: while enabled, mm_free parks small blocks on
+ * quick lists that serve later mallocs of the same size, and merges
+ * them in one pass when the lists fill up or a malloc finds no fit.
+ * Disabling it merges the blocks still parked.
+ */
+extern void mm_set_deferred(int enable);
+
+/*
+ * Size classes: free list i holds the free blocks of bounds[i] bytes
+ * up to bounds[i+1], the last list all bigger ones. mm_set_classes
+ * stages a table for the next mm_init, or the built-in one for NULL.
+ * It returns -1 for an invalid table: the bounds must start at 0 and
+ * ascend, and the chunks must be multiples of 8 below 128 KB.
+ */
+#define MM_MAX_LISTS 16
+
+typedef struct {
+    int nlists;                     /* free lists used, 1 to MM_MAX_LISTS */
+    unsigned bounds[MM_MAX_LISTS];  /* smallest block size of each list */
+    size_t init_chunk;              /* bytes the heap starts with */
+    size_t chunk;                   /* least bytes the heap grows by */
+} mm_classes_t;
+
+extern int mm_set_classes(const mm_classes_t *classes);
+
+/*
+ * Placement policy: best fit takes the smallest free block that fits,
+ * first fit the one at the lowest address, and next fit the one at the
+ * lowest address behind the block placed last, wrapping around to the
+ * start of the heap. mm_set_policy stages a policy for the next
+ * mm_init, and returns -1 for an unknown one.
+ */
+#define MM_BEST_FIT  0
+#define MM_FIRST_FIT 1
+#define MM_NEXT_FIT  2
+
+extern int mm_set_policy(int policy);
+
+/*
+ * Footers: allocated blocks have no footer, the next block's header
+ * records that they are allocated. mm_set_footers(1) stages a heap for
+ * the next mm_init whose allocated blocks reserve the footer word they
+ * had before, to measure what dropping it saves.
+ */
+extern void mm_set_footers(int enable);
+
+/*
+ * Heap checker: mm_check returns 0 if the heap is consistent, and -1
+ * after printing what it found otherwise. The fast level checks the
+ * block the last operation touched, the paranoid level the whole heap.
+ * It only checks in builds with -DMM_CHECK, which also run the fast
+ * level after every operation, and always returns 0 in other builds.
+ */
+#define MM_CHECK_FAST     1
+#define MM_CHECK_PARANOID 2
+
+extern int mm_check(int level);
+
+/*
+ * Heap walk: mm_heap_walk calls visit on every block between the
+ * prologue and the epilogue, in address order, then on every mapped
+ * block with the length of its mapping. mm_heap_info sums the walk up
+ * into a summary of the heap's layout.
+ */
+typedef void (*mm_visit_t)(void *ptr, size_t size, int alloc, void *arg);
+
+#define MM_SIZE_BINS   32 /* free blocks binned by floor(log2(size)) */
+#define MM_MAX_CLASSES 32 /* room for every free list class of mm.c */
+
+typedef struct {
+    size_t heap_bytes;     /* heap size, prologue and epilogue included, plus mappings */
+    size_t alloc_blocks;   /* allocated blocks, slab runs and mappings count as one */
+    size_t alloc_bytes;    /* their size, headers and padding included */
+    size_t free_blocks;    /* free blocks */
+    size_t free_bytes;     /* their size */
+    size_t largest_free;   /* size of the largest free block */
+    size_t free_hist[MM_SIZE_BINS];  /* free blocks of size [2^i, 2^(i+1)) */
+    int nclasses;                    /* free list classes used below */
+    size_t class_blocks[MM_MAX_CLASSES]; /* free blocks in each class */
+    size_t class_bytes[MM_MAX_CLASSES];  /* and their size */
+} mm_heap_info_t;
+
+extern void mm_heap_walk(mm_visit_t visit, void *arg);
+extern void mm_heap_info(mm_heap_info_t *info);
 
 
 /* 
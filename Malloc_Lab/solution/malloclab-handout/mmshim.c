@@ -0,0 +1,217 @@
+/*
+ * mmshim.c - the malloc package of mm.c as the allocator of a real
+ *     process
+ *
+ * usage: LD_PRELOAD=./libmm.so <command>
+ *
+ * libmm.so defines malloc, free, realloc, calloc, posix_memalign,
+ * memalign, aligned_alloc, valloc, pvalloc and malloc_usable_size on
+ * top of mm.c, so every allocation of the command goes through it. memlib.c backs the heap
+ * with real memory: it reserves MAX_HEAP of address space, and only
+ * the pages the heap touches take memory. mm.c runs in threaded mode,
+ * so threaded commands work as well. The heap lock is held across fork,
+ * so a child never inherits it taken by a thread it does not have.
+ *
+ * mm.c aligns payloads to 8 bytes, but the C library promises 16. The
+ * shim over-allocates each block by 16 bytes, and rounds the payload up
+ * inside it. The word before the payload holds its offset from the
+ * start of the block, so free finds the block again. Bigger alignments
+ * come from mm_memalign_offset, which aligns the byte behind that word,
+ * so they cost the word and not the alignment.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define SHIM_ALIGN  16               /* alignment the C library promises */
+#define MAX_REQUEST (SIZE_MAX / 2)   /* larger requests fail at once */
+
+/* The offset of a payload from the start of its mm.c block, and the block */
+#define OFFSET(ptr) (((size_t *)(ptr))[-1])
+#define BLOCK(ptr)  ((char *)(ptr) - OFFSET(ptr))
+
+/* Payload aligned to align in the block, at least one word into it */
+#define ALIGN_IN(block, align) \
+    ((char *)(((unsigned long)(block) + (align)) & ~(unsigned long)((align) - 1)))
+
+static int initialized;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+/*
+ * shim_init - set up the heap and mm.c before the first request
+ */
+static void shim_init(void)
+{
+    static const char msg[] = "mmshim: mm_init failed\n";
+
+    mem_init();
+    mm_set_threaded(1);
+    if (mm_init() < 0) {
+	write(STDERR_FILENO, msg, sizeof(msg) - 1);
+	abort();
+    }
+    initialized = 1;
+}
+
+/*
+ * shim_atfork - hold the heap across fork, registered before the
+ *     command can start a thread
+ */
+static void __attribute__((constructor)) shim_atfork(void)
+{
+    pthread_atfork(mm_fork_prepare, mm_fork_parent, mm_fork_child);
+}
+
+/*
+ * shim_alloc - return size bytes aligned to align, a power of two of
+ *     at least 8 bytes, and cleared if zero is set. Alignments above
+ *     SHIM_ALIGN are never cleared.
+ */
+static void *shim_alloc(size_t size, size_t align, int zero)
+{
+    char *block, *ptr;
+
+    if (!initialized)
+	pthread_once(&init_once, shim_init);
+
+    if (size > MAX_REQUEST || align > MAX_REQUEST) {
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    /* mm.c aligns the payload behind the offset word itself */
+    if (align > SHIM_ALIGN) {
+	if ((block = mm_memalign_offset(align, sizeof(size_t), size + sizeof(size_t))) == NULL) {
+	    errno = ENOMEM;
+	    return NULL;
+	}
+	ptr = block + sizeof(size_t);
+	OFFSET(ptr) = sizeof(size_t);
+	return ptr;
+    }
+
+    if ((block = zero ? mm_calloc(1, size + align) : mm_malloc(size + align)) == NULL) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    ptr = ALIGN_IN(block, align);
+    OFFSET(ptr) = ptr - block;
+    return ptr;
+}
+
+void *malloc(size_t size)
+{
+    return shim_alloc(size, SHIM_ALIGN, 0);
+}
+
+void free(void *ptr)
+{
+    if (ptr != NULL)
+	mm_free(BLOCK(ptr));
+}
+
+/*
+ * realloc - mm_realloc copies the whole old block, payload offset
+ *     included. The new block may sit at another alignment, then the
+ *     payload moves to the new offset.
+ */
+void *realloc(void *ptr, size_t size)
+{
+    size_t offset;
+    char *block;
+
+    if (ptr == NULL)
+	return malloc(size);
+    if (size == 0) {
+	free(ptr);
+	return NULL;
+    }
+
+    /* Room for the old offset, which memalign may have made bigger */
+    offset = OFFSET(ptr);
+    if (size > MAX_REQUEST ||
+	(block = mm_realloc(BLOCK(ptr), size + (offset > SHIM_ALIGN ? offset : SHIM_ALIGN))) == NULL) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    ptr = ALIGN_IN(block, SHIM_ALIGN);
+    if ((size_t)((char *)ptr - block) != offset)
+	memmove(ptr, block + offset, size);
+    OFFSET(ptr) = (char *)ptr - block;
+    return ptr;
+}
+
+/*
+ * calloc - mm_calloc only clears the bytes of the block that earlier
+ *     payloads or the heap's metadata left behind
+ */
+void *calloc(size_t nmemb, size_t size)
+{
+    size_t bytes;
+
+    if (__builtin_mul_overflow(nmemb, size, &bytes)) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return shim_alloc(bytes, SHIM_ALIGN, 1);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    void *ptr;
+
+    if (align < sizeof(void *) || (align & (align - 1)) != 0)
+	return EINVAL;
+    if ((ptr = shim_alloc(size, align > SHIM_ALIGN ? align : SHIM_ALIGN, 0)) == NULL)
+	return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+void *memalign(size_t align, size_t size)
+{
+    if (align == 0 || (align & (align - 1)) != 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+    return shim_alloc(size, align > SHIM_ALIGN ? align : SHIM_ALIGN, 0);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    return memalign(align, size);
+}
+
+void *valloc(size_t size)
+{
+    return memalign(mem_pagesize(), size);
+}
+
+void *pvalloc(size_t size)
+{
+    size_t page = mem_pagesize();
+
+    if (size > MAX_REQUEST) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return memalign(page, size ? (size + page - 1) & ~(page - 1) : page);
+}
+
+/*
+ * malloc_usable_size - the payload of the mm.c block, less the bytes
+ *     in front of the shim's payload
+ */
+size_t malloc_usable_size(void *ptr)
+{
+    if (ptr == NULL)
+	return 0;
+    return mm_usable_size(BLOCK(ptr)) - OFFSET(ptr);
+}
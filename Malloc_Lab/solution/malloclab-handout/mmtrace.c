@@ -0,0 +1,618 @@
+/*
+ * mmtrace.c - record the allocation requests of a real process as a
+ *     .rep trace file for mdriver
+ *
+ * usage: LD_PRELOAD=./libmmtrace.so <command>
+ *
+ * libmmtrace.so wraps malloc, free, realloc, calloc and the aligned
+ * allocators of the C library, and logs every request they serve.
+ * When the process exits, it writes the log as a trace file, named by
+ * the environment variable MMTRACE_FILE, or mmtrace-<pid>.rep. The
+ * processes a command execs trace themselves too. The first process
+ * writes MMTRACE_FILE and marks the environment with its pid, so the
+ * ones it starts write <MMTRACE_FILE>.<pid> instead of overwriting it.
+ *
+ * Each thread logs into a buffer of its own, without a lock. A request
+ * takes its place in the trace from one global counter, which frees
+ * read before they give the block back and allocations after they
+ * get it, so a block is always freed before it is handed out again.
+ * A realloc reads the counter both before and after: the old block
+ * goes back at the first value, and the new one arrives at the second.
+ * Full buffers are appended to <trace>.<pid>.raw in one write each.
+ * A thread marks its buffer while it appends, and the exit waits for
+ * the mark to clear before it writes the buffer out.
+ *
+ * At exit, the records are sorted by the counter and replayed: every
+ * block gets the next free index of the trace, requests for blocks
+ * allocated before the tracing started are dropped, and the blocks
+ * still allocated at the end are freed, so the trace is balanced.
+ * The aligned allocators become memalign requests of the trace, and
+ * calloc its calloc requests.
+ * Zero-byte requests become one-byte requests, since mm_malloc fails
+ * on zero bytes. Requests over INT_MAX bytes do not fit a trace and
+ * are dropped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAXLINE     1024   /* max string size */
+#define LOG_RECORDS 4096   /* records in a thread's buffer */
+
+/* The allocator of the C library, called under its internal names */
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void *__libc_valloc(size_t size);
+extern void *__libc_pvalloc(size_t size);
+
+/* Types of record */
+enum {LOG_ALLOC, LOG_FREE, LOG_REALLOC_FROM, LOG_REALLOC_TO, LOG_CALLOC};
+
+/* One request, or one half of a realloc */
+typedef struct {
+    unsigned long seq;  /* place in the trace */
+    unsigned long ptr;  /* block allocated or freed */
+    unsigned long arg;  /* size, or for LOG_REALLOC_FROM the seq of its LOG_REALLOC_TO */
+    int type;
+    unsigned align;     /* alignment of a LOG_ALLOC by an aligned allocator, or 0 */
+} record_t;
+
+/* The buffer of a thread, reused by later threads once it exits */
+typedef struct log {
+    struct log *next;   /* all buffers ever made */
+    int owned;          /* a thread logs into it */
+    int writing;        /* the thread is appending to it or flushing it */
+    int count;          /* records not yet written */
+    record_t records[LOG_RECORDS];
+} log_t;
+
+/* A hash map from block address or seq to trace index */
+typedef struct {
+    unsigned long *keys;  /* 0 is an empty slot */
+    int *ids;
+    size_t mask;          /* slots - 1, a power of two */
+    int shift;            /* 64 - log2(slots), the hash keeps the top bits */
+    size_t count;
+} map_t;
+
+/* Tracing state */
+enum {TRACE_OFF, TRACE_ON, TRACE_DONE};
+
+static int state = TRACE_OFF;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key;
+static pid_t trace_pid;
+static int raw_fd = -1;
+static char trace_path[MAXLINE];
+static char raw_path[MAXLINE + 32];
+static unsigned long next_seq = 1;
+static log_t *logs;
+
+static __thread log_t *my_log;
+static __thread int busy;  /* the thread is in the tracer, its own requests are not logged */
+
+/*
+ * flush_log - append the records of a buffer to the raw log
+ */
+static void flush_log(log_t *log)
+{
+    if (log->count > 0 && raw_fd >= 0)
+	write(raw_fd, log->records, log->count * sizeof(record_t));
+    log->count = 0;
+}
+
+/*
+ * enter_log - mark a buffer as being written, return 0 if tracing
+ *     stopped and the buffer is to be left alone
+ */
+static int enter_log(log_t *log)
+{
+    /* Either trace_exit sees the mark and waits, or this sees it stopped */
+    __atomic_store_n(&log->writing, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&state, __ATOMIC_SEQ_CST) == TRACE_ON)
+	return 1;
+    __atomic_store_n(&log->writing, 0, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void leave_log(log_t *log)
+{
+    __atomic_store_n(&log->writing, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * release_log - flush the buffer of an exiting thread and give it up.
+ *     Once tracing stopped, trace_exit writes the buffer out instead.
+ */
+static void release_log(void *arg)
+{
+    log_t *log = (log_t *)arg;
+
+    if (enter_log(log)) {
+	flush_log(log);
+	leave_log(log);
+    }
+    __atomic_store_n(&log->owned, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * stop_child - a forked child keeps the raw log of its parent, so it
+ *     stops tracing and leaves the records to the parent
+ */
+static void stop_child(void)
+{
+    state = TRACE_DONE;
+    raw_fd = -1;
+    my_log = NULL;
+}
+
+static void trace_init(void)
+{
+    char *path = getenv("MMTRACE_FILE");
+    char *root = getenv("MMTRACE_ROOT");
+    char pid[32];
+
+    trace_pid = getpid();
+    snprintf(pid, sizeof(pid), "%d", (int)trace_pid);
+    if (path == NULL || strlen(path) >= MAXLINE - sizeof(pid))
+	snprintf(trace_path, MAXLINE, "mmtrace-%s.rep", pid);
+    else if (root == NULL || strcmp(root, pid) == 0) {
+	/* The first process, or a program it exec'd, the processes it starts inherit the mark */
+	strcpy(trace_path, path);
+	setenv("MMTRACE_ROOT", pid, 1);
+    }
+    else
+	snprintf(trace_path, MAXLINE, "%s.%s", path, pid);
+    snprintf(raw_path, sizeof(raw_path), "%s.%s.raw", trace_path, pid);
+
+    /* A raw log of this pid was left by a program this process exec'd
+     * away from, or by a dead one, no other live process has the pid */
+    if ((raw_fd = open(raw_path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644)) < 0 &&
+	(errno != EEXIST || unlink(raw_path) < 0 ||
+	 (raw_fd = open(raw_path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644)) < 0))
+	return;
+    pthread_key_create(&log_key, release_log);
+    pthread_atfork(NULL, NULL, stop_child);
+    state = TRACE_ON;
+}
+
+/*
+ * get_log - the buffer of this thread, claiming one a finished thread
+ *     left behind or pushing a new one on the list of buffers
+ */
+static log_t *get_log(void)
+{
+    log_t *log;
+    int unowned;
+
+    for (log = __atomic_load_n(&logs, __ATOMIC_ACQUIRE); log != NULL; log = log->next) {
+	unowned = 0;
+	if (__atomic_compare_exchange_n(&log->owned, &unowned, 1, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	    break;
+    }
+    if (log == NULL) {
+	log = (log_t *)mmap(NULL, sizeof(log_t), PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (log == MAP_FAILED)
+	    return NULL;
+	log->owned = 1;
+	log->next = __atomic_load_n(&logs, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&logs, &log->next, log, 1,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	    ;
+    }
+    pthread_setspecific(log_key, log);
+    return log;
+}
+
+/*
+ * tracing - return 1 if this request is to be logged, setting up the
+ *     tracer on the first one
+ */
+static int tracing(void)
+{
+    if (__atomic_load_n(&state, __ATOMIC_RELAXED) == TRACE_OFF && !busy) {
+	busy = 1;
+	pthread_once(&init_once, trace_init);
+	busy = 0;
+    }
+    return __atomic_load_n(&state, __ATOMIC_RELAXED) == TRACE_ON && !busy;
+}
+
+/*
+ * take_seq - the next place in the trace
+ */
+static unsigned long take_seq(void)
+{
+    return __atomic_fetch_add(&next_seq, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * log_request - append a record to the buffer of this thread
+ */
+static void log_request(int type, unsigned long seq, void *ptr, unsigned long arg,
+			unsigned align)
+{
+    record_t *r;
+
+    busy = 1;
+    if (my_log == NULL)
+	my_log = get_log();
+    if (my_log != NULL && enter_log(my_log)) {
+	if (my_log->count == LOG_RECORDS)
+	    flush_log(my_log);
+	r = &my_log->records[my_log->count++];
+	r->seq = seq;
+	r->ptr = (unsigned long)ptr;
+	r->arg = arg;
+	r->type = type;
+	r->align = align;
+	leave_log(my_log);
+    }
+    busy = 0;
+}
+
+/*
+ * log_alloc - log the block an allocation returned, align is 0 unless
+ *     an aligned allocator returned it
+ */
+static void *log_alloc(void *ptr, size_t size, size_t align)
+{
+    if (ptr != NULL)
+	log_request(LOG_ALLOC, take_seq(), ptr, size, align);
+    return ptr;
+}
+
+void *malloc(size_t size)
+{
+    if (!tracing())
+	return __libc_malloc(size);
+    return log_alloc(__libc_malloc(size), size, 0);
+}
+
+void free(void *ptr)
+{
+    if (ptr != NULL && tracing())
+	log_request(LOG_FREE, take_seq(), ptr, 0, 0);
+    __libc_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    unsigned long seq;
+    void *new_ptr;
+
+    if (ptr == NULL)
+	return malloc(size);
+    if (!tracing())
+	return __libc_realloc(ptr, size);
+
+    /* Shrinking to zero bytes frees the block */
+    if (size == 0) {
+	free(ptr);
+	return NULL;
+    }
+
+    seq = take_seq();
+    if ((new_ptr = __libc_realloc(ptr, size)) != NULL) {
+	unsigned long to_seq = take_seq();
+	log_request(LOG_REALLOC_FROM, seq, ptr, to_seq, 0);
+	log_request(LOG_REALLOC_TO, to_seq, new_ptr, size, 0);
+    }
+    return new_ptr;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *ptr;
+
+    if (!tracing())
+	return __libc_calloc(nmemb, size);
+    if ((ptr = __libc_calloc(nmemb, size)) != NULL)
+	log_request(LOG_CALLOC, take_seq(), ptr, nmemb * size, 0);
+    return ptr;
+}
+
+void *memalign(size_t align, size_t size)
+{
+    if (!tracing())
+	return __libc_memalign(align, size);
+    return log_alloc(__libc_memalign(align, size), size, align);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    return memalign(align, size);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    void *ptr;
+
+    if (align < sizeof(void *) || (align & (align - 1)) != 0)
+	return EINVAL;
+    if ((ptr = memalign(align, size)) == NULL)
+	return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+void *valloc(size_t size)
+{
+    if (!tracing())
+	return __libc_valloc(size);
+    return log_alloc(__libc_valloc(size), size, getpagesize());
+}
+
+void *pvalloc(size_t size)
+{
+    if (!tracing())
+	return __libc_pvalloc(size);
+    return log_alloc(__libc_pvalloc(size), size, getpagesize());
+}
+
+/*
+ * map_init - an empty map with room for 2^bits keys
+ */
+static void map_init(map_t *map, int bits)
+{
+    map->mask = ((size_t)1 << bits) - 1;
+    map->shift = 64 - bits;
+    map->count = 0;
+    map->keys = (unsigned long *)calloc(map->mask + 1, sizeof(unsigned long));
+    map->ids = (int *)malloc((map->mask + 1) * sizeof(int));
+    if (map->keys == NULL || map->ids == NULL) {
+	fprintf(stderr, "mmtrace: out of memory\n");
+	exit(1);
+    }
+}
+
+/*
+ * map_slot - the home slot of a key, from the top bits of its product
+ *     with 2^64 / phi, which every bit of the key reaches
+ */
+static size_t map_slot(map_t *map, unsigned long key)
+{
+    return (size_t)((key * 0x9e3779b97f4a7c15UL) >> map->shift);
+}
+
+/*
+ * map_put - map a key that is not in the map to an index
+ */
+static void map_put(map_t *map, unsigned long key, int id)
+{
+    map_t old;
+    size_t i;
+
+    /* Grow at half full, moving every key over */
+    if (2 * (map->count + 1) > map->mask + 1) {
+	old = *map;
+	map_init(map, __builtin_ctzl(old.mask + 1) + 1);
+	for (i = 0; i <= old.mask; i++)
+	    if (old.keys[i] != 0)
+		map_put(map, old.keys[i], old.ids[i]);
+	free(old.keys);
+	free(old.ids);
+    }
+
+    for (i = map_slot(map, key); map->keys[i] != 0; i = (i + 1) & map->mask)
+	;
+    map->keys[i] = key;
+    map->ids[i] = id;
+    map->count++;
+}
+
+/*
+ * map_take - remove a key and return its index, -1 if it is not there
+ */
+static int map_take(map_t *map, unsigned long key)
+{
+    size_t i, j, home;
+    int id;
+
+    for (i = map_slot(map, key); map->keys[i] != key; i = (i + 1) & map->mask)
+	if (map->keys[i] == 0)
+	    return -1;
+    id = map->ids[i];
+
+    /* Shift the keys behind it back, so no probe sequence breaks */
+    for (j = (i + 1) & map->mask; map->keys[j] != 0; j = (j + 1) & map->mask) {
+	home = map_slot(map, map->keys[j]);
+	if (((j - home) & map->mask) >= ((j - i) & map->mask)) {
+	    map->keys[i] = map->keys[j];
+	    map->ids[i] = map->ids[j];
+	    i = j;
+	}
+    }
+    map->keys[i] = 0;
+    map->count--;
+    return id;
+}
+
+static int record_compare(const void *a, const void *b)
+{
+    unsigned long x = ((const record_t *)a)->seq;
+    unsigned long y = ((const record_t *)b)->seq;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * replay - turn the sorted records into trace requests, writing them
+ *     to out unless it is NULL, and count the indexes, requests and
+ *     the peak of the allocated bytes
+ */
+static void replay(record_t *records, size_t n, FILE *out,
+		   int *num_ids, int *num_ops, long *peak)
+{
+    map_t blocks, reallocs;
+    int *sizes = NULL;  /* size of each allocated index, 0 once freed */
+    int max_ids = 0, id, old;
+    long live = 0;
+    size_t i, size;
+
+    map_init(&blocks, 10);
+    map_init(&reallocs, 4);
+    *num_ids = *num_ops = 0;
+    *peak = 0;
+
+    for (i = 0; i < n; i++) {
+	record_t *r = &records[i];
+
+	/* There are 4 situations */
+	switch (r->type) {
+	case LOG_FREE:
+	    /* 1. A free of a block the trace knows */
+	    if ((id = map_take(&blocks, r->ptr)) < 0)
+		continue;
+	    break;
+
+	case LOG_REALLOC_FROM:
+	    /* 2. The old half of a realloc, its index waits for the new block */
+	    if ((id = map_take(&blocks, r->ptr)) >= 0)
+		map_put(&reallocs, r->arg, id);
+	    continue;
+
+	default:
+	    /* 3. An allocation, or the new half of a realloc. A block that is
+	     * still in the map was freed behind the tracer's back. */
+	    if ((old = map_take(&blocks, r->ptr)) >= 0) {
+		if (out != NULL)
+		    fprintf(out, "f %d\n", old);
+		live -= sizes[old];
+		sizes[old] = 0;
+		(*num_ops)++;
+	    }
+	    id = (r->type == LOG_REALLOC_TO) ? map_take(&reallocs, r->seq) : -1;
+	    size = (r->arg > 0) ? r->arg : 1;
+	    if (size > INT_MAX) {
+		if (id < 0)
+		    continue;
+		break;
+	    }
+	    if (id < 0) {
+		if (*num_ids == max_ids) {
+		    max_ids = max_ids ? 2 * max_ids : 1024;
+		    if ((sizes = (int *)realloc(sizes, max_ids * sizeof(int))) == NULL) {
+			fprintf(stderr, "mmtrace: out of memory\n");
+			exit(1);
+		    }
+		}
+		id = (*num_ids)++;
+		sizes[id] = 0;
+		if (out != NULL && r->align > 0)
+		    fprintf(out, "m %d %u %d\n", id, r->align, (int)size);
+		else if (out != NULL && r->type == LOG_CALLOC)
+		    fprintf(out, "c %d %d\n", id, (int)size);
+		else if (out != NULL)
+		    fprintf(out, "a %d %d\n", id, (int)size);
+	    }
+	    else if (out != NULL)
+		fprintf(out, "r %d %d\n", id, (int)size);
+	    map_put(&blocks, r->ptr, id);
+	    live += (long)size - sizes[id];
+	    sizes[id] = (int)size;
+	    *peak = (live > *peak) ? live : *peak;
+	    (*num_ops)++;
+	    continue;
+	}
+
+	/* 4. The block is gone: freed, or reallocated past INT_MAX bytes */
+	if (out != NULL)
+	    fprintf(out, "f %d\n", id);
+	live -= sizes[id];
+	sizes[id] = 0;
+	(*num_ops)++;
+    }
+
+    /* Balance the trace, freeing what is left */
+    for (id = 0; id < *num_ids; id++) {
+	if (sizes[id] != 0) {
+	    if (out != NULL)
+		fprintf(out, "f %d\n", id);
+	    (*num_ops)++;
+	}
+    }
+
+    free(blocks.keys);
+    free(blocks.ids);
+    free(reallocs.keys);
+    free(reallocs.ids);
+    free(sizes);
+}
+
+/*
+ * write_trace - sort the raw log and write it as a .rep trace file
+ */
+static void write_trace(void)
+{
+    record_t *records;
+    struct stat st;
+    size_t n;
+    int fd, num_ids, num_ops;
+    long peak;
+    FILE *out;
+
+    if ((fd = open(raw_path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+	fprintf(stderr, "mmtrace: could not read %s\n", raw_path);
+	return;
+    }
+    n = st.st_size / sizeof(record_t);
+    records = (record_t *)malloc(n * sizeof(record_t) + 1);
+    if (records == NULL ||
+	read(fd, records, n * sizeof(record_t)) != (ssize_t)(n * sizeof(record_t))) {
+	fprintf(stderr, "mmtrace: could not read %s\n", raw_path);
+	close(fd);
+	free(records);
+	return;
+    }
+    close(fd);
+    qsort(records, n, sizeof(record_t), record_compare);
+
+    /* The header needs the counts, so replay once to count and once to write */
+    replay(records, n, NULL, &num_ids, &num_ops, &peak);
+    if ((out = fopen(trace_path, "w")) == NULL) {
+	fprintf(stderr, "mmtrace: could not create %s\n", trace_path);
+	free(records);
+	return;
+    }
+    fprintf(out, "%ld\n%d\n%d\n%d\n", (peak < INT_MAX) ? peak : INT_MAX, num_ids, num_ops, 1);
+    replay(records, n, out, &num_ids, &num_ops, &peak);
+    fclose(out);
+    free(records);
+    unlink(raw_path);
+}
+
+/*
+ * trace_exit - stop tracing, write out every buffer, and write the trace
+ */
+static void __attribute__((destructor)) trace_exit(void)
+{
+    log_t *log;
+
+    if (state != TRACE_ON || getpid() != trace_pid)
+	return;
+    __atomic_store_n(&state, TRACE_DONE, __ATOMIC_SEQ_CST);
+
+    /* Threads still running may be halfway through a record, wait for them */
+    for (log = __atomic_load_n(&logs, __ATOMIC_ACQUIRE); log != NULL; log = log->next) {
+	while (__atomic_load_n(&log->writing, __ATOMIC_ACQUIRE))
+	    sched_yield();
+	flush_log(log);
+    }
+    close(raw_fd);
+    raw_fd = -1;
+    write_trace();
+}
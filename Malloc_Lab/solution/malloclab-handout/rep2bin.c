@@ -0,0 +1,96 @@
+/*
+ * rep2bin.c - convert a .rep trace file to the binary format in trace.h
+ *
+ * usage: rep2bin <in.rep> <out>
+ *
+ * mdriver maps the binary file and replays its requests in place, so
+ * a long trace costs no parsing time when it is loaded.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trace.h"
+
+#define MAXLINE 1024 /* max string size */
+
+static void app_error(char *msg, char *path)
+{
+    fprintf(stderr, "%s %s\n", msg, path);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    trace_header_t header;
+    traceop_t op;
+    char type[MAXLINE];
+    unsigned index, size, align;
+    int max_index = -1;
+    int num_ops = 0;
+
+    if (argc != 3) {
+	fprintf(stderr, "usage: %s <in.rep> <out>\n", argv[0]);
+	exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL)
+	app_error("Could not open", argv[1]);
+    if ((out = fopen(argv[2], "wb")) == NULL)
+	app_error("Could not create", argv[2]);
+
+    /* The four header lines of the .rep file */
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    if (fscanf(in, "%d %d %d %d", &header.sugg_heapsize, &header.num_ids,
+	       &header.num_ops, &header.weight) != 4)
+	app_error("Bogus header in tracefile", argv[1]);
+    fwrite(&header, sizeof(header), 1, out);
+
+    /* One record per request line */
+    while (fscanf(in, "%s", type) != EOF) {
+	switch (type[0]) {
+	case 'a':
+	case 'r':
+	case 'c':
+	    if (fscanf(in, "%u %u", &index, &size) != 2)
+		app_error("Bogus request in tracefile", argv[1]);
+	    op.type = (type[0] == 'a') ? ALLOC : (type[0] == 'r') ? REALLOC : CALLOC;
+	    op.index = index;
+	    op.size = size;
+	    op.align = 0;
+	    break;
+	case 'm':
+	    if (fscanf(in, "%u %u %u", &index, &align, &size) != 3)
+		app_error("Bogus request in tracefile", argv[1]);
+	    op.type = MEMALIGN;
+	    op.index = index;
+	    op.size = size;
+	    op.align = align;
+	    break;
+	case 'f':
+	    if (fscanf(in, "%u", &index) != 1)
+		app_error("Bogus request in tracefile", argv[1]);
+	    op.type = FREE;
+	    op.index = index;
+	    op.size = 0;
+	    op.align = 0;
+	    break;
+	default:
+	    app_error("Bogus type character in tracefile", argv[1]);
+	}
+	if (index >= (1u << 29))
+	    app_error("Index does not fit a record in tracefile", argv[1]);
+	max_index = ((int)index > max_index) ? (int)index : max_index;
+	fwrite(&op, sizeof(op), 1, out);
+	num_ops++;
+    }
+
+    /* mdriver trusts these counts, so check them here */
+    if (num_ops != header.num_ops || max_index != header.num_ids - 1)
+	app_error("Request counts do not match the header of", argv[1]);
+
+    fclose(in);
+    if (fclose(out) != 0)
+	app_error("Could not write", argv[2]);
+    return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+/*
+ * trace.h - binary trace file format
+ *
+ * A binary trace holds the same requests as a .rep file: a fixed
+ * header followed by num_ops packed records in the host's byte
+ * order. The records have the layout of traceop_t, so the driver
+ * can map the file and use them in place, without parsing.
+ */
+
+#define TRACE_MAGIC   0x5254424d  /* "MBTR" read as a little-endian word */
+#define TRACE_VERSION 2
+
+/* Header at the start of a binary trace file */
+typedef struct {
+    unsigned magic;      /* TRACE_MAGIC */
+    unsigned version;    /* TRACE_VERSION */
+    int sugg_heapsize;   /* the four header values of the .rep file */
+    int num_ids;
+    int num_ops;
+    int weight;
+} trace_header_t;
+
+/* Types of request */
+enum {ALLOC, FREE, REALLOC, MEMALIGN, CALLOC};
+
+/* Characterizes a single trace operation (allocator request), 12 bytes */
+typedef struct {
+    unsigned type : 3;                /* type of request */
+    unsigned index : 29;              /* index for free() to use later */
+    int size;                         /* byte size of alloc/realloc/calloc request */
+    unsigned align;                   /* alignment of a memalign request */
+} traceop_t;
+
+#endif /* __TRACE_H_ */
@@ -0,0 +1,363 @@
+/*
+ * tuneclasses.c - search for the free list classes and chunk sizes
+ *     that give mm.c the best performance index on a set of traces
+ *
+ * usage: tuneclasses [-d <mdriver>] [-o <out>] [-t <dir>] [-f <file>]...
+ *
+ * The candidate class tables come from the block sizes the traces
+ * request. For each number of lists, one table splits the requests
+ * that can reach the free lists into lists of about equal counts.
+ * Geometric tables and the power-of-two table mm.c uses by default
+ * are tried as well.
+ *
+ * Each candidate is written to a temporary file and scored by running
+ *
+ *     mdriver -a -g -C <table> <the -t and -f options>
+ *
+ * and reading the unrounded performance index it prints. The search
+ * takes the best table at the default chunk sizes, then the best
+ * chunk for that table, then the best initial chunk. It writes the
+ * winner in the format mdriver -C reads, to <out> or stdout.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "trace.h"
+
+#define MAXLINE   1024     /* max string size */
+#define MAXLISTS  16       /* MM_MAX_LISTS of mm.h */
+#define MAXCANDS  64       /* most class tables tried */
+
+/* Requests that reach the free lists of mm.c: bigger ones come from
+ * slab runs, their block sizes stay below the tree of large blocks */
+#define SLAB_MAX   64
+#define TREE_LIMIT 1024
+
+/* Block size of a request in mm.c, header and alignment included */
+#define BLOCK_SIZE(size) ((size) <= 12 ? 16 : (((size) + 4 + 7) & ~7))
+
+/* A free list class table, as mdriver -C reads it */
+typedef struct {
+    int nlists;
+    unsigned bounds[MAXLISTS];
+    long chunk;
+    long init_chunk;
+} table_t;
+
+static char *mdriver = "./mdriver";
+static char trace_args[8 * MAXLINE] = "";  /* -t and -f options for mdriver */
+static double hist[TREE_LIMIT / 8];        /* requests of each block size */
+static char *default_tracefiles[] = {
+    DEFAULT_TRACEFILES, NULL
+};
+
+static void app_error(char *msg, char *arg)
+{
+    fprintf(stderr, "%s %s\n", msg, arg);
+    exit(1);
+}
+
+/*
+ * count_request - add one malloc, realloc or memalign request to the
+ *     histogram
+ */
+static void count_request(int size)
+{
+    if (size > SLAB_MAX && BLOCK_SIZE(size) < TREE_LIMIT)
+	hist[BLOCK_SIZE(size) / 8]++;
+}
+
+/*
+ * read_sizes - add the requests of a .rep or binary trace file to the
+ *     histogram
+ */
+static void read_sizes(char *path)
+{
+    FILE *fp;
+    trace_header_t header;
+    traceop_t op;
+    char type[MAXLINE];
+    unsigned index, align;
+    int size;
+
+    if ((fp = fopen(path, "rb")) == NULL)
+	app_error("Could not open", path);
+
+    /* A binary trace starts with its magic number */
+    if (fread(&header, sizeof(header), 1, fp) == 1 && header.magic == TRACE_MAGIC) {
+	while (fread(&op, sizeof(op), 1, fp) == 1)
+	    if (op.type != FREE)
+		count_request(op.size);
+	fclose(fp);
+	return;
+    }
+
+    /* Otherwise the four header values and one request per line */
+    rewind(fp);
+    if (fscanf(fp, "%d %d %d %d", &header.sugg_heapsize, &header.num_ids,
+	       &header.num_ops, &header.weight) != 4)
+	app_error("Bogus header in tracefile", path);
+    while (fscanf(fp, "%s", type) != EOF) {
+	if (type[0] == 'f') {
+	    if (fscanf(fp, "%u", &index) != 1)
+		app_error("Bogus request in tracefile", path);
+	}
+	else if (type[0] == 'm') {
+	    if (fscanf(fp, "%u %u %d", &index, &align, &size) != 3)
+		app_error("Bogus request in tracefile", path);
+	    count_request(size);
+	}
+	else if (fscanf(fp, "%u %d", &index, &size) == 2)
+	    count_request(size);
+	else
+	    app_error("Bogus request in tracefile", path);
+    }
+    fclose(fp);
+}
+
+/*
+ * add_trace_arg - pass an option with a path on to mdriver
+ */
+static void add_trace_arg(char *opt, char *path)
+{
+    if (strlen(trace_args) + strlen(path) + 8 >= sizeof(trace_args))
+	app_error("Too many traces at", path);
+    strcat(trace_args, " ");
+    strcat(trace_args, opt);
+    strcat(trace_args, " '");
+    strcat(trace_args, path);
+    strcat(trace_args, "'");
+}
+
+/*
+ * write_table - write a class table in the format of mdriver -C
+ */
+static void write_table(FILE *fp, table_t *t)
+{
+    int i;
+
+    fprintf(fp, "lists");
+    for (i = 0; i < t->nlists; i++)
+	fprintf(fp, " %u", t->bounds[i]);
+    fprintf(fp, "\nchunk %ld\ninitchunk %ld\n", t->chunk, t->init_chunk);
+}
+
+/*
+ * score - run mdriver with a class table and return its unrounded
+ *     performance index, 0 if it found errors
+ */
+static double score(table_t *t)
+{
+    char path[] = "/tmp/tuneclassesXXXXXX";
+    char cmd[10 * MAXLINE], line[MAXLINE];
+    double index = 0;
+    FILE *fp;
+    int fd;
+
+    if ((fd = mkstemp(path)) < 0 || (fp = fdopen(fd, "w")) == NULL)
+	app_error("Could not create", path);
+    write_table(fp, t);
+    fclose(fp);
+
+    sprintf(cmd, "%s -a -g -C %s%s", mdriver, path, trace_args);
+    if ((fp = popen(cmd, "r")) == NULL)
+	app_error("Could not run", mdriver);
+    while (fgets(line, MAXLINE, fp) != NULL)
+	sscanf(line, "score:%lf", &index);
+    pclose(fp);
+    unlink(path);
+
+    fprintf(stderr, "%8.3f  %2d lists, chunk %ld, initchunk %ld\n",
+	    index, t->nlists, t->chunk, t->init_chunk);
+    return index;
+}
+
+/*
+ * add_table - append a table to the candidates, unless it is there already
+ */
+static int add_table(table_t *cands, int n, table_t *t)
+{
+    int i;
+
+    if (n == MAXCANDS)
+	return n;
+    for (i = 0; i < n; i++)
+	if (cands[i].nlists == t->nlists &&
+	    !memcmp(cands[i].bounds, t->bounds, t->nlists * sizeof(unsigned)))
+	    return n;
+    cands[n] = *t;
+    return n + 1;
+}
+
+/*
+ * quantile_table - the table whose lists split the requests in the
+ *     histogram into nlists parts of about equal counts
+ */
+static table_t quantile_table(int nlists, double total)
+{
+    table_t t;
+    double sum = 0;
+    int i, size;
+
+    t.nlists = 1;
+    t.bounds[0] = 0;
+    for (size = 16; size < TREE_LIMIT && t.nlists < nlists; size += 8) {
+	if (sum >= total * t.nlists / nlists)
+	    t.bounds[t.nlists++] = size;
+	sum += hist[size / 8];
+    }
+    for (i = t.nlists; i < MAXLISTS; i++)
+	t.bounds[i] = 0;
+    return t;
+}
+
+/*
+ * geometric_table - the table whose bounds grow by a factor from 32
+ */
+static table_t geometric_table(double factor)
+{
+    table_t t;
+    double bound;
+    unsigned size;
+    int i;
+
+    t.nlists = 1;
+    t.bounds[0] = 0;
+    for (bound = 32; bound < TREE_LIMIT && t.nlists < MAXLISTS; bound *= factor) {
+	size = ((unsigned)bound + 7) & ~7;
+	if (size > t.bounds[t.nlists - 1])
+	    t.bounds[t.nlists++] = size;
+    }
+    for (i = t.nlists; i < MAXLISTS; i++)
+	t.bounds[i] = 0;
+    return t;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tuneclasses [-d <mdriver>] [-o <out>] [-t <dir>] [-f <file>]...\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-d <mdriver>  The driver to score tables with (default ./mdriver).\n");
+    fprintf(stderr, "\t-o <out>      Write the best table to <out> instead of stdout.\n");
+    fprintf(stderr, "\t-t <dir>      Tune for the default traces in <dir>.\n");
+    fprintf(stderr, "\t-f <file>     Tune for <file>, repeat for several.\n");
+}
+
+int main(int argc, char **argv)
+{
+    table_t cands[MAXCANDS], best, t;
+    static const long chunks[] = {1<<9, 1<<10, 1<<11, 1<<12, 1<<13, 1<<14, 1<<15, 1<<16};
+    char *tracedir = TRACEDIR;
+    char *outfile = NULL;
+    char path[MAXLINE];
+    double total = 0, best_score, builtin_score, s;
+    int ncands = 0, nfiles = 0;
+    int c, i;
+    FILE *out = stdout;
+
+    while ((c = getopt(argc, argv, "d:o:t:f:h")) != EOF) {
+	switch (c) {
+	case 'd':
+	    mdriver = optarg;
+	    break;
+	case 'o':
+	    outfile = optarg;
+	    break;
+	case 't':
+	    tracedir = optarg;
+	    break;
+	case 'f':
+	    read_sizes(optarg);
+	    add_trace_arg("-f", optarg);
+	    nfiles++;
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (optind != argc) {
+	usage();
+	exit(1);
+    }
+
+    /* Without -f, the default traces of mdriver */
+    if (nfiles == 0) {
+	for (i = 0; default_tracefiles[i] != NULL; i++) {
+	    snprintf(path, MAXLINE, "%s/%s", tracedir, default_tracefiles[i]);
+	    read_sizes(path);
+	}
+	add_trace_arg("-t", tracedir);
+    }
+
+    /* The power-of-two table of mm.c, with the default chunk sizes */
+    t = geometric_table(2);
+    t.chunk = 1<<12;
+    t.init_chunk = 1<<6;
+    ncands = add_table(cands, ncands, &t);
+
+    /* Tables fitted to the request sizes, and finer geometric ones */
+    for (i = 0; i < TREE_LIMIT / 8; i++)
+	total += hist[i];
+    for (i = 2; i <= MAXLISTS && total > 0; i++) {
+	t = quantile_table(i, total);
+	t.chunk = cands[0].chunk;
+	t.init_chunk = cands[0].init_chunk;
+	ncands = add_table(cands, ncands, &t);
+    }
+    t = geometric_table(1.5);
+    t.chunk = cands[0].chunk;
+    t.init_chunk = cands[0].init_chunk;
+    ncands = add_table(cands, ncands, &t);
+    t = geometric_table(1.25);
+    t.chunk = cands[0].chunk;
+    t.init_chunk = cands[0].init_chunk;
+    ncands = add_table(cands, ncands, &t);
+
+    /* 1. The best table at the default chunk sizes */
+    best = cands[0];
+    best_score = builtin_score = score(&cands[0]);
+    for (i = 1; i < ncands; i++) {
+	if ((s = score(&cands[i])) > best_score) {
+	    best = cands[i];
+	    best_score = s;
+	}
+    }
+
+    /* 2. The best chunk for that table */
+    t = best;
+    for (i = 0; i < (int)(sizeof(chunks) / sizeof(chunks[0])); i++) {
+	if ((t.chunk = chunks[i]) == cands[0].chunk)
+	    continue;
+	if ((s = score(&t)) > best_score) {
+	    best = t;
+	    best_score = s;
+	}
+    }
+
+    /* 3. The best initial chunk, up to the chunk itself */
+    t = best;
+    for (t.init_chunk = 1<<6; t.init_chunk <= best.chunk; t.init_chunk <<= 2) {
+	if (t.init_chunk == cands[0].init_chunk)
+	    continue;
+	if ((s = score(&t)) > best_score) {
+	    best = t;
+	    best_score = s;
+	}
+    }
+
+    if (outfile != NULL && (out = fopen(outfile, "w")) == NULL)
+	app_error("Could not create", outfile);
+    fprintf(out, "# tuneclasses: score %.3f, the built-in table scores %.3f\n",
+	    best_score, builtin_score);
+    write_table(out, &best);
+    if (out != stdout)
+	fclose(out);
+    return 0;
+}